@@ -0,0 +1,60 @@
+#ifndef SNOW_ACTIVESET_H
+#define SNOW_ACTIVESET_H
+
+
+#include <cstddef>
+#include <vector>
+
+
+/**
+ * Subset of the nodes of a grid (e.g. the nodes with mass), numbered compactly in the order they were inserted
+ *
+ * Linear systems on the grid can be reduced to the subset: their vectors then hold one entry per active node, entry a
+ * being node set[a], and getCompactIndex() maps a node back to its entry.
+ */
+class ActiveSet {
+public:
+
+    /**
+     * Empties the set, for a grid of numNodes nodes
+     */
+    void reset(size_t numNodes) {
+        nodes.clear();
+        compactIndices.assign(numNodes, -1);
+    }
+
+    void insert(unsigned int i) {
+        compactIndices[i] = static_cast<int>(nodes.size());
+        nodes.push_back(i);
+    }
+
+    size_t size() const {
+        return nodes.size();
+    }
+
+    bool empty() const {
+        return nodes.empty();
+    }
+
+    unsigned int operator[](size_t a) const {
+        return nodes[a];
+    }
+
+    bool contains(unsigned int i) const {
+        return compactIndices[i] >= 0;
+    }
+
+    // Entry of node i in the reduced vectors, -1 if the node isn't active
+    int getCompactIndex(unsigned int i) const {
+        return compactIndices[i];
+    }
+
+private:
+
+    std::vector<unsigned int> nodes;
+    std::vector<int> compactIndices;
+
+};
+
+
+#endif //SNOW_ACTIVESET_H
@@ -0,0 +1,115 @@
+#ifndef SNOW_BITPLANE_H
+#define SNOW_BITPLANE_H
+
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+/**
+ * One bit per node of a grid, packed in 64-bit words along its rows (the z axis of the grids, which is contiguous in
+ * memory), so per-node flags can be combined a row at a time with bitwise operations
+ *
+ * Each row starts on a word boundary. Bits past rowLength stay 0 as long as only set() writes them, so the padding of
+ * words combined with &, | and ^ stays 0 too; complements need masking with paddingMask().
+ */
+class BitPlane {
+public:
+
+    static unsigned int const wordSize = 64;
+
+    /**
+     * Clears the plane, for numRows rows of rowLength nodes
+     */
+    void reset(size_t numRows, size_t rowLength) {
+        this->numRows = numRows;
+        this->rowLength = rowLength;
+        wordsPerRow = (rowLength + wordSize - 1) / wordSize;
+        words.assign(numRows * wordsPerRow, 0);
+    }
+
+    size_t getNumRows() const {
+        return numRows;
+    }
+
+    size_t getRowLength() const {
+        return rowLength;
+    }
+
+    size_t getWordsPerRow() const {
+        return wordsPerRow;
+    }
+
+    void set(size_t row, size_t i) {
+        words[row * wordsPerRow + i / wordSize] |= uint64_t(1) << (i % wordSize);
+    }
+
+    bool test(size_t row, size_t i) const {
+        return (words[row * wordsPerRow + i / wordSize] >> (i % wordSize)) & 1;
+    }
+
+    uint64_t &word(size_t row, size_t k) {
+        return words[row * wordsPerRow + k];
+    }
+
+    uint64_t word(size_t row, size_t k) const {
+        return words[row * wordsPerRow + k];
+    }
+
+    /**
+     * Word k of the row read from bit offset on, i.e. bit i of the result is bit k * wordSize + i + offset of the row
+     * (offset < wordSize)
+     */
+    uint64_t word(size_t row, size_t k, unsigned int offset) const {
+        auto result = word(row, k) >> offset;
+        if (offset > 0 && k + 1 < wordsPerRow) {
+            result |= word(row, k + 1) << (wordSize - offset);
+        }
+        return result;
+    }
+
+    /**
+     * Mask of the bits of word k of a row that are nodes of the row
+     */
+    uint64_t paddingMask(size_t k) const {
+        auto numBits = rowLength - k * wordSize;
+        return numBits >= wordSize ? ~uint64_t(0) : (uint64_t(1) << numBits) - 1;
+    }
+
+    size_t count() const {
+        size_t result = 0;
+        for (auto w : words) {
+            result += __builtin_popcountll(w);
+        }
+        return result;
+    }
+
+    /**
+     * Runs f(row, i) for every set bit, in row-major order
+     */
+    template<typename F>
+    void forEachSetBit(F f) const {
+        for (size_t row = 0; row < numRows; row++) {
+            for (size_t k = 0; k < wordsPerRow; k++) {
+                auto w = word(row, k);
+                while (w) {
+                    f(row, k * wordSize + __builtin_ctzll(w));
+                    w &= w - 1;
+                }
+            }
+        }
+    }
+
+private:
+
+    size_t numRows = 0;
+    size_t rowLength = 0;
+    size_t wordsPerRow = 0;
+
+    std::vector<uint64_t> words;
+
+};
+
+
+#endif //SNOW_BITPLANE_H
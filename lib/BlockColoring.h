@@ -0,0 +1,111 @@
+#ifndef SNOW_BLOCKCOLORING_H
+#define SNOW_BLOCKCOLORING_H
+
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "logging.h"
+
+
+/**
+ * Bins particles into cubic blocks of grid nodes and schedules the blocks in 8 color phases (by the parity of the
+ * block coordinates) so that the stencils scattered from blocks of the same color never touch the same grid node.
+ *
+ * A particle is binned by the minimum corner of its stencil. With a stencil at most blockSize + 1 nodes wide, blocks
+ * of the same color are always separated by a full block, so they can be processed concurrently without locking.
+ * Particles are visited in index order within a block and blocks are visited in a fixed order within a color, so
+ * every grid node receives its contributions in the same order regardless of the number of threads.
+ */
+class BlockColoring {
+public:
+
+    static unsigned int const blockSize = 4;
+
+    static unsigned int const numColors = 8;
+
+    /**
+     * Bins particles by their stencil minimum corner gmin(p) on a grid of the given size (in nodes)
+     */
+    template<typename F>
+    void bin(glm::uvec3 const &gridSize, unsigned int numParticles, F gmin) {
+        numBlocks = (gridSize + glm::uvec3(blockSize - 1)) / blockSize;
+        auto totalNumBlocks = numBlocks.x * numBlocks.y * numBlocks.z;
+
+        particleBlocks.resize(numParticles);
+        blockOffsets.assign(totalNumBlocks + 1, 0);
+
+        // Count
+        for (unsigned int p = 0; p < numParticles; p++) {
+            auto b = getBlockIndex(gmin(p));
+            particleBlocks[p] = b;
+            blockOffsets[b + 1]++;
+        }
+        for (unsigned int b = 0; b < totalNumBlocks; b++) {
+            blockOffsets[b + 1] += blockOffsets[b];
+        }
+
+        // Scatter (stable, keeps particles in index order within each block)
+        blockParticles.resize(numParticles);
+        blockCursors.assign(blockOffsets.begin(), blockOffsets.end() - 1);
+        for (unsigned int p = 0; p < numParticles; p++) {
+            blockParticles[blockCursors[particleBlocks[p]]++] = p;
+        }
+
+        // Non-empty blocks per color
+        for (auto &blocks : colorBlocks) {
+            blocks.clear();
+        }
+        for (unsigned int x = 0; x < numBlocks.x; x++) {
+            for (unsigned int y = 0; y < numBlocks.y; y++) {
+                for (unsigned int z = 0; z < numBlocks.z; z++) {
+                    auto b = (x * numBlocks.y + y) * numBlocks.z + z;
+                    if (blockOffsets[b] == blockOffsets[b + 1]) continue;
+                    colorBlocks[(x % 2) * 4 + (y % 2) * 2 + z % 2].push_back(b);
+                }
+            }
+        }
+    }
+
+    /**
+     * Runs f(p) for every binned particle, one color phase at a time
+     */
+    template<typename F>
+    void forEachParticle(unsigned int numThreads, F f) const {
+        LOG_ASSERT(numThreads > 0);
+
+        for (auto const &blocks : colorBlocks) {
+            auto numColorBlocks = static_cast<int>(blocks.size());
+
+#pragma omp parallel for num_threads(numThreads) schedule(dynamic, 1)
+            for (int i = 0; i < numColorBlocks; i++) {
+                auto b = blocks[i];
+                for (auto j = blockOffsets[b]; j < blockOffsets[b + 1]; j++) {
+                    f(blockParticles[j]);
+                }
+            }
+        }
+    }
+
+private:
+
+    glm::uvec3 numBlocks;
+
+    std::vector<unsigned int> particleBlocks;
+    std::vector<unsigned int> blockOffsets;
+    std::vector<unsigned int> blockCursors;
+    std::vector<unsigned int> blockParticles;
+
+    std::vector<unsigned int> colorBlocks[numColors];
+
+    unsigned int getBlockIndex(glm::ivec3 const &gmin) const {
+        // Stencils hanging off the grid only touch nodes near the boundary, so they can share the boundary block
+        auto b = glm::clamp(gmin / static_cast<int>(blockSize), glm::ivec3(0), glm::ivec3(numBlocks) - 1);
+        return (b.x * numBlocks.y + b.y) * numBlocks.z + b.z;
+    }
+
+};
+
+
+#endif //SNOW_BLOCKCOLORING_H
@@ -0,0 +1,283 @@
+#include "CellMultigrid.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+void CellMultigrid::setup(StencilMatrix const &A, std::vector<glm::uvec3> const &locations, glm::uvec3 const &size) {
+    LOG_ASSERT(A.size() == locations.size());
+
+    levels.resize(1);
+    levels[0].A = A;
+
+    auto levelLocations = locations;
+    auto levelSize = size;
+
+    if (smoother == RED_BLACK_GAUSS_SEIDEL) {
+        levels[0].sor.setup(levelLocations);
+    }
+
+    while (levels.back().A.size() > coarsestSize) {
+        auto &fine = levels.back();
+        auto numRows = fine.A.size();
+
+        // Aggregate 2x2x2 blocks of cells
+
+        auto coarseSize = (levelSize + glm::uvec3(1)) / 2u;
+        coarseCells.reset(coarseSize.x * coarseSize.y * coarseSize.z);
+
+        fine.parents.resize(numRows);
+
+        for (auto a = 0; a < numRows; a++) {
+            auto location = levelLocations[a] / 2u;
+            auto c = (location.x * coarseSize.y + location.y) * coarseSize.z + location.z;
+
+            if (!coarseCells.contains(c)) {
+                coarseCells.insert(c);
+            }
+
+            fine.parents[a] = coarseCells.getCompactIndex(c);
+        }
+
+        // Galerkin product, couplings inside a block add to its diagonal
+
+        Level coarse;
+        coarse.A.reset(coarseCells.size());
+
+        for (auto a = 0; a < numRows; a++) {
+            auto const &row = fine.A[a];
+            auto &coarseRow = coarse.A[fine.parents[a]];
+
+            coarseRow.diagonal += row.diagonal;
+
+            for (auto k = 0; k < StencilMatrix::numNeighbors; k++) {
+                if (row.neighbors[k] < 0) continue;
+
+                auto neighborParent = fine.parents[row.neighbors[k]];
+                if (neighborParent == fine.parents[a]) {
+                    coarseRow.diagonal += row.coefficients[k];
+                } else {
+                    coarseRow.neighbors[k] = neighborParent;
+                    coarseRow.coefficients[k] += row.coefficients[k];
+                }
+            }
+        }
+
+        levelLocations.resize(coarseCells.size());
+        for (auto a = 0; a < coarseCells.size(); a++) {
+            auto c = coarseCells[a];
+            levelLocations[a] = glm::uvec3(c / (coarseSize.y * coarseSize.z), (c / coarseSize.z) % coarseSize.y,
+                                           c % coarseSize.z);
+        }
+        levelSize = coarseSize;
+
+        if (smoother == RED_BLACK_GAUSS_SEIDEL) {
+            coarse.sor.setup(levelLocations);
+        }
+
+        levels.push_back(std::move(coarse));
+    }
+
+    for (auto &level : levels) {
+        auto numRows = level.A.size();
+        level.x.resize(numRows);
+        level.b.resize(numRows);
+        level.r.resize(numRows);
+    }
+
+    factorizeCoarsest();
+}
+
+void CellMultigrid::vcycle(std::vector<double> &z, std::vector<double> const &r) {
+    LOG_ASSERT(!levels.empty() && r.size() == levels[0].A.size());
+
+    auto &fine = levels[0];
+
+    std::copy(r.begin(), r.end(), fine.b.begin());
+    cycle(0);
+
+    z.resize(r.size());
+    std::copy(fine.x.begin(), fine.x.end(), z.begin());
+}
+
+ConjugateResidualResult CellMultigrid::solve(std::vector<double> &x, std::vector<double> const &b, int k,
+                                             double relativeTolerance, double absoluteTolerance) {
+    LOG_ASSERT(!levels.empty() && x.size() == b.size() && b.size() == levels[0].A.size());
+
+    auto const &A = levels[0].A;
+    auto n = b.size();
+
+    residual.resize(n);
+    correction.resize(n);
+
+    auto computeResidual = [&]() {
+        double dot_r_r = 0;
+        for (auto a = 0; a < n; a++) {
+            residual[a] = b[a] - A.applyRow(a, x);
+            dot_r_r += residual[a] * residual[a];
+        }
+        return dot_r_r;
+    };
+
+    ConjugateResidualResult result;
+
+    auto dot_r_r = computeResidual();
+    result.initialResidual = std::sqrt(dot_r_r);
+
+    auto tolerance = std::max(absoluteTolerance * absoluteTolerance,
+                              relativeTolerance * relativeTolerance * dot_r_r);
+
+    while (result.iterations < k && dot_r_r >= tolerance) {
+        vcycle(correction, residual);
+
+        for (auto a = 0; a < n; a++) {
+            x[a] += correction[a];
+        }
+
+        dot_r_r = computeResidual();
+        result.iterations++;
+    }
+
+    result.finalResidual = std::sqrt(dot_r_r);
+    result.termination = dot_r_r < tolerance ? ConjugateResidualResult::CONVERGED
+                                             : ConjugateResidualResult::MAX_ITERATIONS;
+
+    return result;
+}
+
+void CellMultigrid::factorizeCoarsest() {
+    auto const &A = levels.back().A;
+    auto n = A.size();
+
+    coarsestLU.assign(n * n, 0);
+    coarsestPivots.resize(n);
+
+    for (auto a = 0; a < n; a++) {
+        coarsestLU[a * n + a] = A[a].diagonal;
+        for (auto k = 0; k < StencilMatrix::numNeighbors; k++) {
+            if (A[a].neighbors[k] >= 0) {
+                coarsestLU[a * n + A[a].neighbors[k]] += A[a].coefficients[k];
+            }
+        }
+    }
+
+    // Gaussian elimination with partial pivoting
+    for (auto j = 0; j < n; j++) {
+        auto pivot = j;
+        for (auto i = j + 1; i < n; i++) {
+            if (std::abs(coarsestLU[i * n + j]) > std::abs(coarsestLU[pivot * n + j])) {
+                pivot = i;
+            }
+        }
+
+        coarsestPivots[j] = pivot;
+        if (pivot != j) {
+            std::swap_ranges(coarsestLU.begin() + j * n, coarsestLU.begin() + (j + 1) * n,
+                             coarsestLU.begin() + pivot * n);
+        }
+
+        auto diagonal = coarsestLU[j * n + j];
+        if (diagonal == 0) continue; // Singular, leaves the component at 0
+
+        for (auto i = j + 1; i < n; i++) {
+            auto factor = coarsestLU[i * n + j] /= diagonal;
+            for (auto l = j + 1; l < n; l++) {
+                coarsestLU[i * n + l] -= factor * coarsestLU[j * n + l];
+            }
+        }
+    }
+}
+
+void CellMultigrid::solveCoarsest(std::vector<double> &x, std::vector<double> const &b) {
+    auto n = b.size();
+
+    std::copy(b.begin(), b.end(), x.begin());
+
+    for (auto j = 0; j < n; j++) {
+        std::swap(x[j], x[coarsestPivots[j]]);
+    }
+
+    // L has a unit diagonal
+    for (auto i = 0; i < n; i++) {
+        for (auto j = 0; j < i; j++) {
+            x[i] -= coarsestLU[i * n + j] * x[j];
+        }
+    }
+
+    for (int i = static_cast<int>(n) - 1; i >= 0; i--) {
+        for (auto j = i + 1; j < n; j++) {
+            x[i] -= coarsestLU[i * n + j] * x[j];
+        }
+
+        auto diagonal = coarsestLU[i * n + i];
+        x[i] = diagonal != 0 ? x[i] / diagonal : 0;
+    }
+}
+
+void CellMultigrid::smooth(Level &level, unsigned int numSweeps, bool fromZero, bool reverse) {
+    auto n = level.A.size();
+
+    if (smoother == RED_BLACK_GAUSS_SEIDEL) {
+        if (fromZero) {
+            std::fill(level.x.begin(), level.x.end(), 0);
+        }
+
+        for (auto sweep = 0; sweep < numSweeps; sweep++) {
+            level.sor.sweep(level.A, level.x, level.b, reverse);
+        }
+        return;
+    }
+
+    for (auto sweep = 0; sweep < numSweeps; sweep++) {
+        if (fromZero && sweep == 0) {
+            for (auto a = 0; a < n; a++) {
+                level.x[a] = level.A[a].diagonal != 0 ? smootherWeight * level.b[a] / level.A[a].diagonal : 0;
+            }
+            continue;
+        }
+
+        for (auto a = 0; a < n; a++) {
+            level.r[a] = level.b[a] - level.A.applyRow(a, level.x);
+        }
+
+        for (auto a = 0; a < n; a++) {
+            if (level.A[a].diagonal == 0) continue; // No equation
+            level.x[a] += smootherWeight * level.r[a] / level.A[a].diagonal;
+        }
+    }
+}
+
+void CellMultigrid::cycle(size_t l) {
+    auto &level = levels[l];
+
+    if (l + 1 == levels.size()) {
+        solveCoarsest(level.x, level.b);
+        return;
+    }
+
+    if (numSmoothingSweeps > 0) {
+        smooth(level, numSmoothingSweeps, true, false);
+    } else {
+        std::fill(level.x.begin(), level.x.end(), 0);
+    }
+
+    // Restrict the residual
+
+    auto &coarse = levels[l + 1];
+    std::fill(coarse.b.begin(), coarse.b.end(), 0);
+
+    auto n = level.A.size();
+    for (auto a = 0; a < n; a++) {
+        coarse.b[level.parents[a]] += level.b[a] - level.A.applyRow(a, level.x);
+    }
+
+    cycle(l + 1);
+
+    // Prolong the correction
+
+    for (auto a = 0; a < n; a++) {
+        level.x[a] += coarseCorrectionWeight * coarse.x[level.parents[a]];
+    }
+
+    smooth(level, numSmoothingSweeps, false, true);
+}
@@ -0,0 +1,100 @@
+#ifndef SNOW_CELLMULTIGRID_H
+#define SNOW_CELLMULTIGRID_H
+
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "ActiveSet.h"
+#include "RedBlackSOR.h"
+#include "StencilMatrix.h"
+#include "conjugate_residual_solver.h"
+
+
+/**
+ * Geometric multigrid for symmetric 7-point operators on a subset of the cells of a regular grid (e.g. the pressure
+ * system of the cells with mass)
+ *
+ * Each coarser level aggregates the cells of 2x2x2 blocks of the finer one and its operator is the Galerkin product
+ * R A P, with P piecewise constant and R = P^T. This keeps the operators 7-point and carries over the coefficients of
+ * the fine operator, so the coarse levels see the same boundary cells and the same varying coefficients. Levels are
+ * coarsened until they have at most coarsestSize cells, the coarsest one is solved directly.
+ *
+ * A V-cycle smooths with numSmoothingSweeps damped Jacobi or red-black Gauss-Seidel sweeps before and after the
+ * coarse-grid correction, Gauss-Seidel sweeping black cells first after the correction to stay symmetric. Piecewise
+ * constant prolongation underestimates smooth errors, so the correction is scaled by coarseCorrectionWeight. A V-cycle
+ * is a fixed linear operator, symmetric and definite if A is, so it can precondition the conjugate residual method.
+ */
+class CellMultigrid {
+public:
+
+    enum Smoother {
+        JACOBI,
+        RED_BLACK_GAUSS_SEIDEL
+    };
+
+    Smoother smoother = JACOBI;
+    unsigned int numSmoothingSweeps = 2;
+    double smootherWeight = 6.0 / 7; // Damped Jacobi
+    double coarseCorrectionWeight = 1.5;
+    size_t coarsestSize = 64;
+
+    /**
+     * Builds the levels for A, row a of which is the cell at locations[a] of a grid of the given size
+     */
+    void setup(StencilMatrix const &A, std::vector<glm::uvec3> const &locations, glm::uvec3 const &size);
+
+    size_t getNumLevels() const {
+        return levels.size();
+    }
+
+    /**
+     * z = one V-cycle on Az = r starting from z = 0, an approximation of A^-1 r
+     */
+    void vcycle(std::vector<double> &z, std::vector<double> const &r);
+
+    /**
+     * Solves Ax = b with V-cycles, with the stopping criteria of ConjugateResidualSolver
+     * The initial guess is passed in as x
+     * The result will be written in x
+     */
+    ConjugateResidualResult solve(std::vector<double> &x, std::vector<double> const &b, int k,
+                                  double relativeTolerance, double absoluteTolerance);
+
+private:
+
+    struct Level {
+        StencilMatrix A;
+        std::vector<int> parents; // Row of the next coarser level each row is aggregated into
+        RedBlackSOR sor; // Cell colors for red-black smoothing
+
+        // Workspace
+        std::vector<double> x;
+        std::vector<double> b;
+        std::vector<double> r;
+    };
+
+    std::vector<Level> levels;
+
+    ActiveSet coarseCells;
+
+    // LU factors of the coarsest operator, row-major, with the row permutation
+    std::vector<double> coarsestLU;
+    std::vector<int> coarsestPivots;
+
+    std::vector<double> residual;
+    std::vector<double> correction;
+
+    void factorizeCoarsest();
+
+    void solveCoarsest(std::vector<double> &x, std::vector<double> const &b);
+
+    void smooth(Level &level, unsigned int numSweeps, bool fromZero, bool reverse);
+
+    void cycle(size_t l);
+
+};
+
+
+#endif //SNOW_CELLMULTIGRID_H
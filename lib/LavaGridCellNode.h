@@ -5,6 +5,7 @@
 #include "Node.h"
 
 
+// NB: Cell types are kept as bit planes by LavaSolver (getGridCellNodeMask)
 enum LavaGridCellNodeType {
     EMPTY,
     COLLIDING,
@@ -31,8 +32,6 @@ struct LavaGridCellNode : public Node {
 
     double inv_lambda{}; // lambda^(-1) rasterized on grid face
 
-    LavaGridCellNodeType type = EMPTY;
-
 };
 
 
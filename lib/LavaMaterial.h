@@ -0,0 +1,53 @@
+#ifndef SNOW_LAVAMATERIAL_H
+#define SNOW_LAVAMATERIAL_H
+
+
+/**
+ * Material properties shared by the particles of a LavaSolver, which refer to their material by index
+ */
+struct LavaMaterial {
+
+    LavaMaterial() {
+        // Water
+
+        criticalCompression = 2.5e-2;
+        criticalStretch = 7.5e-3;
+        hardeningCoefficient = 10;
+        youngsModulus0 = 1.4e5;
+        poissonsRatio = 0.2;
+
+        thermalConductivity = 0.606;
+        specificHeat = 4.184e3;
+        fusionTemperature = 0;
+        latentHeatOfFusion = 334e3;
+
+        // Init
+
+        updateLameParameters();
+    }
+
+    double criticalCompression;
+    double criticalStretch;
+    double hardeningCoefficient;
+    double youngsModulus0;
+    double poissonsRatio;
+
+    double thermalConductivity; // at 25 degC
+    double specificHeat; // [J / (kg degC)]
+    double fusionTemperature; // [degC]
+    double latentHeatOfFusion; // [J / kg]
+
+    // Dependent values on youngsModulus0 and poissonsRatio
+
+    double mu0;
+    double lambda0;
+
+    void updateLameParameters() {
+        mu0 = youngsModulus0 / (2 * (1 + poissonsRatio));
+        lambda0 = youngsModulus0 * poissonsRatio / ((1 + poissonsRatio) * (1 - 2 * poissonsRatio));
+    }
+
+};
+
+
+#endif //SNOW_LAVAMATERIAL_H
@@ -2,17 +2,16 @@
 
 #include <fstream>
 
-#include <glm/gtc/type_ptr.hpp>
-#include <Dense>
+#include "morton.h"
+#include "svd3.h"
 
-#include "conjugate_residual_solver.h"
 
+// Neighbors of a cell, in the order -x, +x, -y, +y, -z, +z
+static glm::ivec3 const cellNeighborOffsets[6] = {
+        {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}
+};
 
-typedef Eigen::Matrix<double, 3, 3> eigen_matrix3;
-typedef Eigen::Matrix<double, 3, 1> eigen_vector3;
-
-
-LavaSolver::LavaSolver(double h, glm::uvec3 const &size) : h(h), size(size) {
+LavaSolver::LavaSolver(double h, glm::uvec3 const &size) : materials(1), h(h), size(size) {
 
 }
 
@@ -20,24 +19,11 @@ LavaSolver::LavaSolver(std::string const &filename) {
     loadState(filename);
 }
 
-inline void svd(glm::dmat3 const &m, glm::dmat3 &u, glm::dvec3 &e, glm::dmat3 &v) {
-    Eigen::Map<eigen_matrix3 const> mmap(glm::value_ptr(m));
-    Eigen::Map<eigen_matrix3> umap(glm::value_ptr(u));
-    Eigen::Map<eigen_vector3> emap(glm::value_ptr(e));
-    Eigen::Map<eigen_matrix3> vmap(glm::value_ptr(v));
-
-    Eigen::JacobiSVD<eigen_matrix3, Eigen::NoQRPreconditioner> svd;
-    svd.compute(mmap, Eigen::ComputeFullV | Eigen::ComputeFullU);
-    umap = svd.matrixU();
-    emap = svd.singularValues();
-    vmap = svd.matrixV();
-}
-
 inline glm::dmat3 polarRot(glm::dmat3 const &m) {
     glm::dmat3 u;
     glm::dvec3 e;
     glm::dmat3 v;
-    svd(m, u, e, v);
+    svd3(m, u, e, v);
     return u * glm::transpose(v);
 }
 
@@ -45,7 +31,7 @@ inline void polarDecompose(glm::dmat3 const &m, glm::dmat3 &r, glm::dmat3 &s) {
     glm::dmat3 u;
     glm::dvec3 e;
     glm::dmat3 v;
-    svd(m, u, e, v);
+    svd3(m, u, e, v);
     r = u * glm::transpose(v);
     s = v * glm::dmat3(e.x, 0, 0, 0, e.y, 0, 0, 0, e.z) * glm::transpose(v);
 }
@@ -63,6 +49,12 @@ void LavaSolver::propagateSimulationParametersUpdate() {
 
     invh = 1 / h;
 
+    for (auto &material : materials) {
+        material.updateLameParameters();
+    }
+
+    pressureWarmStart.clear();
+
     gridCellNodes.clear();
     for (auto x = 0; x < size.x; x++) {
         for (auto y = 0; y < size.y; y++) {
@@ -112,6 +104,20 @@ inline double ddot(glm::dmat3 a, glm::dmat3 b) {
            a[2][0] * b[2][0] + a[2][1] * b[2][1] + a[2][2] * b[2][2];
 }
 
+void LavaSolver::sortParticleNodes() {
+    // Particles appended since the last sort are numbered in the order they were added
+    for (auto id = static_cast<unsigned int>(particleIds.size()); id < particleNodes.size(); id++) {
+        particleIds.push_back(id);
+    }
+
+    auto order = mortonOrder(particleNodes.size(), h, [this](unsigned int p) {
+        return particleNodes[p].position;
+    });
+
+    applyOrder(particleNodes, order);
+    applyOrder(particleIds, order);
+}
+
 void LavaSolver::update() {
     LOG(INFO) << "delta_t=" << delta_t << " tick=" << tick << std::endl;
 
@@ -119,6 +125,10 @@ void LavaSolver::update() {
         propagateSimulationParametersUpdate();
     }
 
+    if (sortInterval > 0 && tick % sortInterval == 0) {
+        sortParticleNodes();
+    }
+
     auto numParticleNodes = particleNodes.size();
     auto numGridCellNodes = gridCellNodes.size();
     auto numGridFaceXNodes = gridFaceXNodes.size();
@@ -165,95 +175,27 @@ void LavaSolver::update() {
         faceNode.inv_density = 0;
     }
 
-    for (auto p = 0; p < numParticleNodes; p++) {
-        auto &particleNode = particleNodes[p];
-        auto gcmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1));
-        auto gfxmin = glm::ivec3((particleNode.position / h) - glm::dvec3(0.5, 1, 1));
-        auto gfymin = glm::ivec3((particleNode.position / h) - glm::dvec3(1, 0.5, 1));
-        auto gfzmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1, 1, 0.5));
-
-        double jp = glm::determinant(particleNode.deformPlastic);
-        double je = glm::determinant(particleNode.deformElastic);
-        double j = glm::determinant(particleNode.deformElastic * particleNode.deformPlastic);
-
-        auto e = exp(particleNode.hardeningCoefficient * (1 - jp));
-        auto mu = particleNode.mu0 * e;
-        auto lambda = particleNode.lambda0 * e;
-        auto inv_lambda = 1 / lambda;
-
-        // Nearby weighted grid cell nodes
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gcmin.x + i / 16;
-            auto gy = gcmin.y + (i / 4) % 4;
-            auto gz = gcmin.z + i % 4;
-            if (!isValidGridCellNode(gx, gy, gz)) continue;
-            auto &cellNode = this->gridCellNode(gx, gy, gz);
-
-            // Pre-compute weights
-            particleNode.cell_weight[i] = weight(cellNode, particleNode);
-            particleNode.cell_nabla_weight[i] = nabla_weight(cellNode, particleNode);
-
-            auto particleWeightedMass = particleNode.mass * particleNode.cell_weight[i];
-
-            cellNode.mass += particleWeightedMass;
-            cellNode.j += j * particleWeightedMass;
-            cellNode.je += je * particleWeightedMass;
-            cellNode.specificHeat += particleNode.specificHeat * particleWeightedMass;
-            cellNode.temperature += particleNode.temperature * particleWeightedMass;
-            cellNode.inv_lambda += inv_lambda * particleWeightedMass;
-        }
-
-        // Nearby weighted grid face nodes
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gfxmin.x + i / 16;
-            auto gy = gfxmin.y + (i / 4) % 4;
-            auto gz = gfxmin.z + i % 4;
-            if (!isValidGridFaceXNode(gx, gy, gz)) continue;
-            auto &faceNode = this->gridFaceXNode(gx, gy, gz);
-
-            // Pre-compute weights
-            particleNode.face_x_weight[i] = weight(faceNode, particleNode);
-            particleNode.face_x_nabla_weight[i] = nabla_weight(faceNode, particleNode);
-
-            auto particleWeightedMass = particleNode.mass * particleNode.face_x_weight[i];
-
-            faceNode.mass += particleWeightedMass;
-            faceNode.velocity.x += particleNode.velocity.x * particleWeightedMass;
-            faceNode.thermalConductivity += particleNode.thermalConductivity * particleWeightedMass;
-        }
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gfymin.x + i / 16;
-            auto gy = gfymin.y + (i / 4) % 4;
-            auto gz = gfymin.z + i % 4;
-            if (!isValidGridFaceYNode(gx, gy, gz)) continue;
-            auto &faceNode = this->gridFaceYNode(gx, gy, gz);
-
-            // Pre-compute weights
-            particleNode.face_y_weight[i] = weight(faceNode, particleNode);
-            particleNode.face_y_nabla_weight[i] = nabla_weight(faceNode, particleNode);
+    // Flags of the nodes with mass and of the colliding faces
+    cellOccupancy.reset(size.x * size.y, size.z);
+    faceOccupancy[0].reset((size.x + 1) * size.y, size.z);
+    faceOccupancy[1].reset(size.x * (size.y + 1), size.z);
+    faceOccupancy[2].reset(size.x * size.y, size.z + 1);
+    for (auto axis = 0; axis < 3; axis++) {
+        faceColliding[axis].reset(faceOccupancy[axis].getNumRows(), faceOccupancy[axis].getRowLength());
+    }
 
-            auto particleWeightedMass = particleNode.mass * particleNode.face_y_weight[i];
+    if (parallelRasterization) {
 
-            faceNode.mass += particleWeightedMass;
-            faceNode.velocity.y += particleNode.velocity.y * particleWeightedMass;
-            faceNode.thermalConductivity += particleNode.thermalConductivity * particleWeightedMass;
-        }
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gfzmin.x + i / 16;
-            auto gy = gfzmin.y + (i / 4) % 4;
-            auto gz = gfzmin.z + i % 4;
-            if (!isValidGridFaceZNode(gx, gy, gz)) continue;
-            auto &faceNode = this->gridFaceZNode(gx, gy, gz);
+        binParticleNodes();
 
-            // Pre-compute weights
-            particleNode.face_z_weight[i] = weight(faceNode, particleNode);
-            particleNode.face_z_nabla_weight[i] = nabla_weight(faceNode, particleNode);
+        rasterizationColoring.forEachParticle(numThreads, [this](unsigned int p) {
+            rasterizeParticleNode(p);
+        });
 
-            auto particleWeightedMass = particleNode.mass * particleNode.face_z_weight[i];
+    } else {
 
-            faceNode.mass += particleWeightedMass;
-            faceNode.velocity.z += particleNode.velocity.z * particleWeightedMass;
-            faceNode.thermalConductivity += particleNode.thermalConductivity * particleWeightedMass;
+        for (auto p = 0; p < numParticleNodes; p++) {
+            rasterizeParticleNode(p);
         }
 
     }
@@ -262,6 +204,8 @@ void LavaSolver::update() {
         auto &cellNode = gridCellNodes[i];
 
         if (cellNode.mass > 0) {
+            cellOccupancy.set(cellNode.location.x * size.y + cellNode.location.y, cellNode.location.z);
+
             cellNode.j /= cellNode.mass;
             cellNode.je /= cellNode.mass;
             cellNode.jp = cellNode.j / cellNode.je;
@@ -280,8 +224,11 @@ void LavaSolver::update() {
 
     for (auto i = 0; i < numGridFaceXNodes; i++) {
         auto &gridFaceNode = gridFaceXNodes[i];
+        auto row = gridFaceNode.location.x * size.y + gridFaceNode.location.y;
 
         if (gridFaceNode.mass > 0) {
+            faceOccupancy[0].set(row, gridFaceNode.location.z);
+
             gridFaceNode.velocity /= gridFaceNode.mass;
             gridFaceNode.thermalConductivity /= gridFaceNode.mass;
         } else {
@@ -290,11 +237,17 @@ void LavaSolver::update() {
         }
 
         gridFaceNode.colliding = isNodeColliding(gridFaceNode);
+        if (gridFaceNode.colliding) {
+            faceColliding[0].set(row, gridFaceNode.location.z);
+        }
     }
     for (auto i = 0; i < numGridFaceYNodes; i++) {
         auto &gridFaceNode = gridFaceYNodes[i];
+        auto row = gridFaceNode.location.x * (size.y + 1) + gridFaceNode.location.y;
 
         if (gridFaceNode.mass > 0) {
+            faceOccupancy[1].set(row, gridFaceNode.location.z);
+
             gridFaceNode.velocity /= gridFaceNode.mass;
             gridFaceNode.thermalConductivity /= gridFaceNode.mass;
         } else {
@@ -303,11 +256,17 @@ void LavaSolver::update() {
         }
 
         gridFaceNode.colliding = isNodeColliding(gridFaceNode);
+        if (gridFaceNode.colliding) {
+            faceColliding[1].set(row, gridFaceNode.location.z);
+        }
     }
     for (auto i = 0; i < numGridFaceZNodes; i++) {
         auto &gridFaceNode = gridFaceZNodes[i];
+        auto row = gridFaceNode.location.x * size.y + gridFaceNode.location.y;
 
         if (gridFaceNode.mass > 0) {
+            faceOccupancy[2].set(row, gridFaceNode.location.z);
+
             gridFaceNode.velocity /= gridFaceNode.mass;
             gridFaceNode.thermalConductivity /= gridFaceNode.mass;
         } else {
@@ -316,6 +275,9 @@ void LavaSolver::update() {
         }
 
         gridFaceNode.colliding = isNodeColliding(gridFaceNode);
+        if (gridFaceNode.colliding) {
+            faceColliding[2].set(row, gridFaceNode.location.z);
+        }
     }
 
     // Compute particle volumes and densities
@@ -347,57 +309,41 @@ void LavaSolver::update() {
 
     // 4. Classify cells ///////////////////////////////////////////////////////////////////////////////////////////////
 
-    int numGellNodesColliding = 0;
+    // A cell is colliding if all its faces are, otherwise interior if all its faces have mass, a word of cells at a time
 
-    for (auto i = 0; i < numGridCellNodes; i++) {
-        auto &cellNode = gridCellNodes[i];
+    for (auto &mask : cellTypeMasks) {
+        mask.reset(size.x * size.y, size.z);
+    }
 
-        auto cellColliding = true;
-        auto cellInterior = true;
+    auto wordsPerRow = cellOccupancy.getWordsPerRow();
 
-        {
-            auto face = gridFaceXNode(cellNode.location);
-            cellColliding &= face.colliding;
-            cellInterior &= face.mass > 0;
-        }
-        {
-            auto face = gridFaceXNode(cellNode.location + glm::uvec3(1, 0, 0));
-            cellColliding &= face.colliding;
-            cellInterior &= face.mass > 0;
-        }
-        {
-            auto face = gridFaceYNode(cellNode.location);
-            cellColliding &= face.colliding;
-            cellInterior &= face.mass > 0;
-        }
-        {
-            auto face = gridFaceYNode(cellNode.location + glm::uvec3(0, 1, 0));
-            cellColliding &= face.colliding;
-            cellInterior &= face.mass > 0;
-        }
-        {
-            auto face = gridFaceZNode(cellNode.location);
-            cellColliding &= face.colliding;
-            cellInterior &= face.mass > 0;
-        }
-        {
-            auto face = gridFaceZNode(cellNode.location + glm::uvec3(0, 0, 1));
-            cellColliding &= face.colliding;
-            cellInterior &= face.mass > 0;
-        }
+    for (unsigned int x = 0; x < size.x; x++) {
+        for (unsigned int y = 0; y < size.y; y++) {
+            auto row = x * size.y + y;
+            auto faceYRow = x * (size.y + 1) + y;
 
-        if (cellColliding) {
-            cellNode.type = COLLIDING;
-            cellNode.temperature = 200; // FIXME: Hard coded hot colliding surface
-            numGellNodesColliding++;
-        } else if (cellInterior) {
-            cellNode.type = INTERIOR;
-        } else {
-            cellNode.type = EMPTY;
+            for (auto k = 0; k < wordsPerRow; k++) {
+                auto faceFlags = [&](BitPlane const *planes) {
+                    return planes[0].word(row, k) & planes[0].word(row + size.y, k) &
+                           planes[1].word(faceYRow, k) & planes[1].word(faceYRow + 1, k) &
+                           planes[2].word(row, k) & planes[2].word(row, k, 1);
+                };
+
+                auto colliding = faceFlags(faceColliding);
+                auto occupied = faceFlags(faceOccupancy);
+
+                cellTypeMasks[COLLIDING].word(row, k) = colliding;
+                cellTypeMasks[INTERIOR].word(row, k) = occupied & ~colliding;
+                cellTypeMasks[EMPTY].word(row, k) = ~(colliding | occupied) & cellOccupancy.paddingMask(k);
+            }
         }
     }
 
-    LOG(INFO) << "numCellNodesColliding=" << numGellNodesColliding << std::endl;
+    cellTypeMasks[COLLIDING].forEachSetBit([this](size_t row, size_t z) {
+        gridCellNodes[row * size.z + z].temperature = 200; // FIXME: Hard coded hot colliding surface
+    });
+
+    LOG(INFO) << "numCellNodesColliding=" << cellTypeMasks[COLLIDING].count() << std::endl;
 
     // 5. MPM velocity update //////////////////////////////////////////////////////////////////////////////////////////
 
@@ -431,12 +377,13 @@ void LavaSolver::update() {
         auto jp = glm::determinant(particleNode.deformPlastic);
         auto je = glm::determinant(particleNode.deformElastic);
 
-        auto e = exp(particleNode.hardeningCoefficient * (1 - jp));
-        auto mu = particleNode.mu0 * e;
-        auto lambda = particleNode.lambda0 * e;
+        auto const &material = materials[particleNode.material];
+        auto e = exp(material.hardeningCoefficient * (1 - jp));
+        auto mu = material.mu0 * e;
+        auto lambda = material.lambda0 * e;
 
         // Set mu to 0 if particle liquid
-        if (particleNode.temperature > particleNode.fusionTemperature + FLT_EPSILON) {
+        if (particleNode.temperature > material.fusionTemperature + FLT_EPSILON) {
             mu = 0;
         }
 
@@ -542,51 +489,15 @@ void LavaSolver::update() {
 
     // 7. Project velocities ///////////////////////////////////////////////////////////////////////////////////////////
 
-    std::vector<double> next_quantity(numGridCellNodes);
-    std::vector<double> quantity(numGridCellNodes);
-
     // Wish to solve for p_c
 
-    for (auto p = 0; p < numParticleNodes; p++) {
-        auto &particleNode = particleNodes[p];
-        auto gmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1));
-
-        // Accumulate control volume
-
-        // Nearby weighted grid nodes
-        double particleNodeDensity0 = 0;
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gmin.x + i / 16;
-            auto gy = gmin.y + (i / 4) % 4;
-            auto gz = gmin.z + i % 4;
-            if (!isValidGridCellNode(gx, gy, gz)) continue;
-            auto &cellNode = this->gridCellNode(gx, gy, gz);
-
-            if (cellNode.type != INTERIOR) continue;
-
-            {
-                auto &faceNode = gridFaceXNode(cellNode.location.x, cellNode.location.y, cellNode.location.z);
-                faceNode.inv_density += weight(faceNode, particleNode);
-            }
-            {
-                auto &faceNode = gridFaceYNode(cellNode.location.x, cellNode.location.y, cellNode.location.z);
-                faceNode.inv_density += weight(faceNode, particleNode);
-            }
-            {
-                auto &faceNode = gridFaceZNode(cellNode.location.x, cellNode.location.y, cellNode.location.z);
-                faceNode.inv_density += weight(faceNode, particleNode);
-            }
-
-        }
-
-    }
-
-    // Density
+    // Density, the control volume of the faces on the min side of interior cells was accumulated during rasterization
 
     for (auto i = 0; i < numGridFaceXNodes; i++) {
         auto &faceNode = gridFaceXNodes[i];
+        auto const &location = faceNode.location;
 
-        if (faceNode.mass > 0) {
+        if (location.x < size.x && isGridCellNodeType(location.x, location.y, location.z, INTERIOR)) {
             faceNode.inv_density *= pow(h, 3) / faceNode.mass;
         } else {
             faceNode.inv_density = 0;
@@ -594,8 +505,9 @@ void LavaSolver::update() {
     }
     for (auto i = 0; i < numGridFaceYNodes; i++) {
         auto &faceNode = gridFaceYNodes[i];
+        auto const &location = faceNode.location;
 
-        if (faceNode.mass > 0) {
+        if (location.y < size.y && isGridCellNodeType(location.x, location.y, location.z, INTERIOR)) {
             faceNode.inv_density *= pow(h, 3) / faceNode.mass;
         } else {
             faceNode.inv_density = 0;
@@ -603,23 +515,34 @@ void LavaSolver::update() {
     }
     for (auto i = 0; i < numGridFaceZNodes; i++) {
         auto &faceNode = gridFaceZNodes[i];
+        auto const &location = faceNode.location;
 
-        if (faceNode.mass > 0) {
+        if (location.z < size.z && isGridCellNodeType(location.x, location.y, location.z, INTERIOR)) {
             faceNode.inv_density *= pow(h, 3) / faceNode.mass;
         } else {
             faceNode.inv_density = 0;
         }
     }
 
-    for (auto c = 0; c < numGridCellNodes; c++) {
-        auto &cellNode = gridCellNodes[c];
+    // The system is reduced to the interior cells with mass, the pressure is 0 elsewhere
+
+    pressureCellNodes.reset(numGridCellNodes);
+
+    cellTypeMasks[INTERIOR].forEachSetBit([this](size_t row, size_t z) {
+        auto c = static_cast<unsigned int>(row * size.z + z);
 
-        // Skip no mass node
-        if (cellNode.type != INTERIOR || cellNode.mass == 0) {
-            quantity[c] = 0;
-            next_quantity[c] = 0;
-            continue;
+        if (gridCellNodes[c].mass != 0) {
+            pressureCellNodes.insert(c);
         }
+    });
+
+    auto numPressureCellNodes = pressureCellNodes.size();
+
+    std::vector<double> next_quantity(numPressureCellNodes);
+    std::vector<double> quantity(numPressureCellNodes);
+
+    for (auto a = 0; a < numPressureCellNodes; a++) {
+        auto &cellNode = gridCellNodes[pressureCellNodes[a]];
 
         // Compute s_c
 
@@ -631,112 +554,131 @@ void LavaSolver::update() {
                     gridFaceZNode(cellNode.location.x, cellNode.location.y, cellNode.location.z + 1).velocity_star.z -
                     gridFaceZNode(cellNode.location.x, cellNode.location.y, cellNode.location.z).velocity_star.z);
 
-        quantity[c] = s_c;
-        next_quantity[c] = -1.0 / cellNode.jp / cellNode.inv_lambda * (cellNode.je - 1);
-//        next_quantity[c] = 0;
+        quantity[a] = s_c;
+        next_quantity[a] = -1.0 / cellNode.jp / cellNode.inv_lambda * (cellNode.je - 1);
+//        next_quantity[a] = 0;
 
     }
 
-    conjugateResidualSolver(this, &LavaSolver::implicitPressureIntegrationMatrix,
-                            next_quantity, quantity, 300);
+    auto cellNodeKey = [this](size_t a) {
+        return pressureCellNodes[a];
+    };
+
+    if (warmStartPressureSolve) {
+        pressureWarmStart.load(next_quantity, cellNodeKey);
+    }
 
-    double cellNodeValues[2] = {0, 0};
-    for (auto i = 0; i < numGridFaceXNodes; i++) {
-        auto &faceNode = gridFaceXNodes[i];
+    pressureSolveResult = solveCellSystem(pressureSystem, pressureCellNodes, &LavaSolver::implicitPressureIntegrationRow,
+                                          pressureSolver, pressureSolveMaxIterations, pressureSolveRelativeTolerance,
+                                          pressureSolveAbsoluteTolerance, pressureSolveRelaxationFactor,
+                                          next_quantity, quantity);
 
-        // Skip faces that don't require pressure correction
-        if (faceNode.location.x == size.x ||
-            gridCellNode(faceNode.location.x, faceNode.location.y, faceNode.location.z).type != INTERIOR)
-            continue;
+    LOG(VERBOSE) << "pressureSolveIterations=" << pressureSolveResult.iterations
+                 << " warmStart=" << warmStartPressureSolve << std::endl;
 
-        // x-min boundary
-        if (faceNode.location.x == 0) {
-            cellNodeValues[0] = 0;
-        } else {
-            cellNodeValues[0] = next_quantity[getGridCellNodeIndex(faceNode.location.x - 1, faceNode.location.y,
-                                                                   faceNode.location.z)];
-        }
+    if (warmStartPressureSolve) {
+        pressureWarmStart.store(next_quantity, cellNodeKey);
+    } else {
+        pressureWarmStart.clear();
+    }
 
-        // x-max boundary
-        if (faceNode.location.x == size.x) {
-            cellNodeValues[1] = 0;
-        } else {
-            cellNodeValues[1] = next_quantity[getGridCellNodeIndex(faceNode.location.x, faceNode.location.y,
-                                                                   faceNode.location.z)];
-        }
+    std::vector<double> pressure(numGridCellNodes);
 
-        faceNode.velocity_star.x -= delta_t * (cellNodeValues[1] - cellNodeValues[0]) * faceNode.inv_density;
+    for (auto a = 0; a < numPressureCellNodes; a++) {
+        pressure[pressureCellNodes[a]] = next_quantity[a];
     }
-    for (auto i = 0; i < numGridFaceYNodes; i++) {
-        auto &faceNode = gridFaceYNodes[i];
 
-        // Skip faces that don't require pressure correction
-        if (faceNode.location.y == size.y ||
-            gridCellNode(faceNode.location.x, faceNode.location.y, faceNode.location.z).type != INTERIOR)
-            continue;
+    // Only the faces on the min side of interior cells require pressure correction
 
-        // y-min boundary
-        if (faceNode.location.y == 0) {
-            cellNodeValues[0] = 0;
-        } else {
-            cellNodeValues[0] = next_quantity[getGridCellNodeIndex(faceNode.location.x, faceNode.location.y - 1,
-                                                                   faceNode.location.z)];
-        }
+    cellTypeMasks[INTERIOR].forEachSetBit([&](size_t row, size_t z) {
+        unsigned int x = row / size.y;
+        unsigned int y = row % size.y;
 
-        // y-max boundary
-        if (faceNode.location.y == size.y) {
-            cellNodeValues[1] = 0;
-        } else {
-            cellNodeValues[1] = next_quantity[getGridCellNodeIndex(faceNode.location.x, faceNode.location.y,
-                                                                   faceNode.location.z)];
-        }
+        auto cellNodePressure = pressure[getGridCellNodeIndex(x, y, z)];
 
-        faceNode.velocity_star.y -= delta_t * (cellNodeValues[1] - cellNodeValues[0]) * faceNode.inv_density;
-    }
-    for (auto i = 0; i < numGridFaceZNodes; i++) {
-        auto &faceNode = gridFaceZNodes[i];
+        {
+            auto &faceNode = gridFaceXNode(x, y, z);
 
-        // Skip faces that don't require pressure correction
-        if (faceNode.location.z == size.z ||
-            gridCellNode(faceNode.location.x, faceNode.location.y, faceNode.location.z).type != INTERIOR)
-            continue;
+            // x-min boundary
+            auto neighborPressure = x == 0 ? 0 : pressure[getGridCellNodeIndex(x - 1, y, z)];
 
-        // z-min boundary
-        if (faceNode.location.z == 0) {
-            cellNodeValues[0] = 0;
-        } else {
-            cellNodeValues[0] = next_quantity[getGridCellNodeIndex(faceNode.location.x, faceNode.location.y,
-                                                                   faceNode.location.z - 1)];
+            faceNode.velocity_star.x -= delta_t * (cellNodePressure - neighborPressure) * faceNode.inv_density;
         }
+        {
+            auto &faceNode = gridFaceYNode(x, y, z);
 
-        // z-max boundary
-        if (faceNode.location.z == size.z) {
-            cellNodeValues[1] = 0;
-        } else {
-            cellNodeValues[1] = next_quantity[getGridCellNodeIndex(faceNode.location.x, faceNode.location.y,
-                                                                   faceNode.location.z)];
+            // y-min boundary
+            auto neighborPressure = y == 0 ? 0 : pressure[getGridCellNodeIndex(x, y - 1, z)];
+
+            faceNode.velocity_star.y -= delta_t * (cellNodePressure - neighborPressure) * faceNode.inv_density;
         }
+        {
+            auto &faceNode = gridFaceZNode(x, y, z);
 
-        faceNode.velocity_star.z -= delta_t * (cellNodeValues[1] - cellNodeValues[0]) * faceNode.inv_density;
-    }
+            // z-min boundary
+            auto neighborPressure = z == 0 ? 0 : pressure[getGridCellNodeIndex(x, y, z - 1)];
+
+            faceNode.velocity_star.z -= delta_t * (cellNodePressure - neighborPressure) * faceNode.inv_density;
+        }
+    });
 
     // 8. Solve heat equation //////////////////////////////////////////////////////////////////////////////////////////
 
+    // The system is reduced to the cells with mass and heat capacity. Cells without have no equation: those at 0 degC
+    // keep it, the others (hot colliding cells) are unknowns conjugate residual can let drift as in the full system,
+    // unless holdHeatBoundaryTemperature makes them fixed (Dirichlet) neighbors. Either way, the fixed cells keep their
+    // temperature
+
+    heatCellNodes.reset(numGridCellNodes);
+
     for (auto c = 0; c < numGridCellNodes; c++) {
         auto &cellNode = gridCellNodes[c];
 
-        quantity[c] = cellNode.temperature;
-        next_quantity[c] = cellNode.temperature;
+        cellNode.temperature_next = cellNode.temperature;
 
+        if ((cellNode.mass != 0 && cellNode.specificHeat != 0) ||
+            (!holdHeatBoundaryTemperature && cellNode.temperature != 0)) {
+            heatCellNodes.insert(c);
+        }
     }
 
-    conjugateResidualSolver(this, &LavaSolver::implicitHeatIntegrationMatrix,
-                            next_quantity, quantity, 50);
+    auto numHeatCellNodes = heatCellNodes.size();
 
-    for (auto c = 0; c < numGridCellNodes; c++) {
-        auto &cellNode = gridCellNodes[c];
+    quantity.resize(numHeatCellNodes);
+    next_quantity.resize(numHeatCellNodes);
+
+    for (auto a = 0; a < numHeatCellNodes; a++) {
+        auto &cellNode = gridCellNodes[heatCellNodes[a]];
 
-        cellNode.temperature_next = next_quantity[c];
+        // Move the fixed neighbors to the right-hand side
+        double neighborValues[6];
+        for (auto k = 0; k < 6; k++) {
+            auto neighbor = glm::ivec3(cellNode.location) + cellNeighborOffsets[k];
+            neighborValues[k] = 0;
+            if (!isValidGridCellNode(neighbor.x, neighbor.y, neighbor.z)) continue;
+
+            auto c = getGridCellNodeIndex(neighbor.x, neighbor.y, neighbor.z);
+            if (!heatCellNodes.contains(c)) {
+                neighborValues[k] = gridCellNodes[c].temperature;
+            }
+        }
+
+        quantity[a] = cellNode.temperature - implicitHeatIntegrationRow(cellNode, 0, neighborValues);
+        next_quantity[a] = cellNode.temperature;
+
+    }
+
+    heatSolveResult = solveCellSystem(heatSystem, heatCellNodes, &LavaSolver::implicitHeatIntegrationRow,
+                                      heatSolver, heatSolveMaxIterations, heatSolveRelativeTolerance,
+                                      heatSolveAbsoluteTolerance, heatSolveRelaxationFactor,
+                                      next_quantity, quantity);
+
+    LOG(VERBOSE) << "heatSolveIterations=" << heatSolveResult.iterations << std::endl;
+
+    for (auto a = 0; a < numHeatCellNodes; a++) {
+        auto &cellNode = gridCellNodes[heatCellNodes[a]];
+
+        cellNode.temperature_next = next_quantity[a];
 
     }
 
@@ -818,45 +760,48 @@ void LavaSolver::update() {
 
     for (auto p = 0; p < numParticleNodes; p++) {
         auto &particleNode = particleNodes[p];
-        auto gcmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1));
-        auto gfxmin = glm::ivec3((particleNode.position / h) - glm::dvec3(0.5, 1, 1));
-        auto gfymin = glm::ivec3((particleNode.position / h) - glm::dvec3(1, 0.5, 1));
-        auto gfzmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1, 1, 0.5));
+        auto const &material = materials[particleNode.material];
+        // The quadratic kernel is nonzero on 3 nodes per axis
+        auto gfxmin = glm::ivec3((particleNode.position / h) - glm::dvec3(0, 0.5, 0.5));
+        auto gfymin = glm::ivec3((particleNode.position / h) - glm::dvec3(0.5, 0, 0.5));
+        auto gfzmin = glm::ivec3((particleNode.position / h) - glm::dvec3(0.5, 0.5, 0));
+
+        StencilWeights<QuadraticBSpline, 3> faceXWeights, faceYWeights, faceZWeights;
+        faceXWeights.compute(particleNode.position, gfxmin, glm::dvec3(-0.5, 0, 0), h, invh);
+        faceYWeights.compute(particleNode.position, gfymin, glm::dvec3(0, -0.5, 0), h, invh);
+        faceZWeights.compute(particleNode.position, gfzmin, glm::dvec3(0, 0, -0.5), h, invh);
 
         glm::dmat3 nabla_v{};
 
         // Nearby weighted grid face nodes
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gfxmin.x + i / 16;
-            auto gy = gfxmin.y + (i / 4) % 4;
-            auto gz = gfxmin.z + i % 4;
+        for (unsigned int i = 0; i < 27; i++) {
+            auto gx = gfxmin.x + i / 9;
+            auto gy = gfxmin.y + (i / 3) % 3;
+            auto gz = gfxmin.z + i % 3;
             if (!isValidGridFaceXNode(gx, gy, gz)) continue;
             auto &faceNode = this->gridFaceXNode(gx, gy, gz);
 
-            nabla_v += glm::outerProduct(glm::dvec3(faceNode.velocity_star.x, 0, 0),
-                                         tight_nabla_weight(faceNode, particleNode));
+            nabla_v += glm::outerProduct(glm::dvec3(faceNode.velocity_star.x, 0, 0), faceXWeights.nabla_weight(i));
 
         }
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gfymin.x + i / 16;
-            auto gy = gfymin.y + (i / 4) % 4;
-            auto gz = gfymin.z + i % 4;
+        for (unsigned int i = 0; i < 27; i++) {
+            auto gx = gfymin.x + i / 9;
+            auto gy = gfymin.y + (i / 3) % 3;
+            auto gz = gfymin.z + i % 3;
             if (!isValidGridFaceYNode(gx, gy, gz)) continue;
             auto &faceNode = this->gridFaceYNode(gx, gy, gz);
 
-            nabla_v += glm::outerProduct(glm::dvec3(0, faceNode.velocity_star.y, 0),
-                                         tight_nabla_weight(faceNode, particleNode));
+            nabla_v += glm::outerProduct(glm::dvec3(0, faceNode.velocity_star.y, 0), faceYWeights.nabla_weight(i));
 
         }
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gfzmin.x + i / 16;
-            auto gy = gfzmin.y + (i / 4) % 4;
-            auto gz = gfzmin.z + i % 4;
+        for (unsigned int i = 0; i < 27; i++) {
+            auto gx = gfzmin.x + i / 9;
+            auto gy = gfzmin.y + (i / 3) % 3;
+            auto gz = gfzmin.z + i % 3;
             if (!isValidGridFaceZNode(gx, gy, gz)) continue;
             auto &faceNode = this->gridFaceZNode(gx, gy, gz);
 
-            nabla_v += glm::outerProduct(glm::dvec3(0, 0, faceNode.velocity_star.z),
-                                         tight_nabla_weight(faceNode, particleNode));
+            nabla_v += glm::outerProduct(glm::dvec3(0, 0, faceNode.velocity_star.z), faceZWeights.nabla_weight(i));
 
         }
 
@@ -867,15 +812,15 @@ void LavaSolver::update() {
         auto deformElastic_prime = multiplier * particleNode.deformElastic;
 
         // Remove deviatoric component if liquid
-        if (particleNode.temperature > particleNode.fusionTemperature + FLT_EPSILON) {
+        if (particleNode.temperature > material.fusionTemperature + FLT_EPSILON) {
             deformElastic_prime = glm::dmat3(pow(glm::determinant(deformElastic_prime), 1.0 / 3.0));
         }
 
         glm::dmat3 u;
         glm::dvec3 e;
         glm::dmat3 v;
-        svd(deformElastic_prime, u, e, v);
-        e = glm::clamp(e, 1 - particleNode.criticalCompression, 1 + particleNode.criticalStretch);
+        svd3(deformElastic_prime, u, e, v);
+        e = clampSingularValues(e, 1 - material.criticalCompression, 1 + material.criticalStretch);
 
         particleNode.deformElastic = u * glm::dmat3(e.x, 0, 0, 0, e.y, 0, 0, 0, e.z) * glm::transpose(v);
         particleNode.deformPlastic =
@@ -915,195 +860,347 @@ void LavaSolver::update() {
 
         auto temperature_next = (1 - alpha) * temperature_pic + alpha * temperature_flip;
 
-        applyTemperatureDifference(particleNode, temperature_next - particleNode.temperature);
+        applyTemperatureDifference(particleNode, materials[particleNode.material],
+                                   temperature_next - particleNode.temperature);
 
     }
 
     tick++;
 }
 
-void LavaSolver::implicitHeatIntegrationMatrix(std::vector<double> &Ax,
-                                               std::vector<double> const &x) {
+void LavaSolver::assembleCellMatrix(ActiveSet const &cellNodes,
+                                    double (LavaSolver::*integrationRow)(LavaGridCellNode const &, double,
+                                                                         double const[6]),
+                                    StencilMatrix &A) {
+    auto numCellNodes = cellNodes.size();
 
-    auto numGridCellNodes = gridCellNodes.size();
+    A.reset(numCellNodes);
 
-    for (auto c = 0; c < numGridCellNodes; c++) {
-        auto const &cellNode = gridCellNodes[c];
+    for (auto a = 0; a < numCellNodes; a++) {
+        auto const &cellNode = gridCellNodes[cellNodes[a]];
+        auto &row = A[a];
 
-        // Continue if later calculation may cause divide-by-zero error
-        if (cellNode.mass == 0 || cellNode.specificHeat == 0) continue;
+        // The rows are linear in the cell and neighbor values, probe them one at a time
+        double neighborValues[6] = {0, 0, 0, 0, 0, 0};
+        row.diagonal = (this->*integrationRow)(cellNode, 1, neighborValues);
 
-        double faceNodeValues[6] = {0, 0, 0, 0, 0, 0};
+        for (auto k = 0; k < 6; k++) {
+            auto neighbor = glm::ivec3(cellNode.location) + cellNeighborOffsets[k];
+            if (!isValidGridCellNode(neighbor.x, neighbor.y, neighbor.z)) continue;
 
-        // x-min boundary
-        if (cellNode.location.x == 0) {
-            faceNodeValues[0] = 0;
-        } else {
-            faceNodeValues[0] = x[c] - x[getGridCellNodeIndex(cellNode.location.x - 1,
-                                                              cellNode.location.y,
-                                                              cellNode.location.z)];
-        }
+            auto b = cellNodes.getCompactIndex(getGridCellNodeIndex(neighbor.x, neighbor.y, neighbor.z));
+            if (b < 0) continue;
 
-        // x-max boundary
-        if (cellNode.location.x == size.x - 1) {
-            faceNodeValues[1] = 0;
-        } else {
-            faceNodeValues[1] = x[getGridCellNodeIndex(cellNode.location.x + 1,
-                                                       cellNode.location.y,
-                                                       cellNode.location.z)] - x[c];
+            neighborValues[k] = 1;
+            row.neighbors[k] = b;
+            row.coefficients[k] = (this->*integrationRow)(cellNode, 0, neighborValues);
+            neighborValues[k] = 0;
         }
+    }
+}
 
-        // y-min boundary
-        if (cellNode.location.y == 0) {
-            faceNodeValues[2] = 0;
-        } else {
-            faceNodeValues[2] = x[c] - x[getGridCellNodeIndex(cellNode.location.x,
-                                                              cellNode.location.y - 1,
-                                                              cellNode.location.z)];
+ConjugateResidualResult LavaSolver::solveCellSystem(CellSystem &system, ActiveSet const &cellNodes,
+                                                    double (LavaSolver::*integrationRow)(LavaGridCellNode const &,
+                                                                                         double, double const[6]),
+                                                    LinearSolverType solver, int k, double relativeTolerance,
+                                                    double absoluteTolerance, double relaxationFactor,
+                                                    std::vector<double> &x, std::vector<double> const &b) {
+    // Masses and coefficients are fixed for the rest of the step, the iterations stream the assembled matrix
+    assembleCellMatrix(cellNodes, integrationRow, system.matrix);
+
+    auto numCellNodes = cellNodes.size();
+
+    std::vector<glm::uvec3> locations;
+    if (solver != CONJUGATE_RESIDUAL) {
+        locations.resize(numCellNodes);
+        for (auto a = 0; a < numCellNodes; a++) {
+            locations[a] = gridCellNodes[cellNodes[a]].location;
         }
+    }
 
-        // y-max boundary
-        if (cellNode.location.y == size.y - 1) {
-            faceNodeValues[3] = 0;
-        } else {
-            faceNodeValues[3] = x[getGridCellNodeIndex(cellNode.location.x,
-                                                       cellNode.location.y + 1,
-                                                       cellNode.location.z)] - x[c];
-        }
+    auto const &A = system.matrix;
+    auto applyA = [&A](std::vector<double> &Ax, std::vector<double> const &x) {
+        A.apply(Ax, x);
+    };
 
-        // z-min boundary
-        if (cellNode.location.z == 0) {
-            faceNodeValues[4] = 0;
-        } else {
-            faceNodeValues[4] = x[c] - x[getGridCellNodeIndex(cellNode.location.x,
-                                                              cellNode.location.y,
-                                                              cellNode.location.z - 1)];
-        }
+    system.crSolver.numThreads = numThreads;
+    system.crSolver.relativeTolerance = relativeTolerance;
+    system.crSolver.absoluteTolerance = absoluteTolerance;
+
+    switch (solver) {
+        case CONJUGATE_RESIDUAL:
+            return system.crSolver.solve(applyA, x, b, k);
+        case RED_BLACK_SOR:
+            system.sor.numThreads = numThreads;
+            system.sor.relaxationFactor = relaxationFactor;
+            system.sor.setup(locations);
+            return system.sor.solve(A, x, b, k, relativeTolerance, absoluteTolerance);
+        case MULTIGRID:
+            system.multigrid.setup(A, locations, size);
+            return system.multigrid.solve(x, b, k, relativeTolerance, absoluteTolerance);
+        case MULTIGRID_CONJUGATE_RESIDUAL:
+        default:
+            system.multigrid.setup(A, locations, size);
+            return system.crSolver.solve(applyA, [&system](std::vector<double> &z, std::vector<double> const &r) {
+                system.multigrid.vcycle(z, r);
+            }, x, b, k);
+    }
+}
 
-        // z-max boundary
-        if (cellNode.location.z == size.z - 1) {
-            faceNodeValues[5] = 0;
-        } else {
-            faceNodeValues[5] = x[getGridCellNodeIndex(cellNode.location.x,
-                                                       cellNode.location.y,
-                                                       cellNode.location.z + 1)] - x[c];
-        }
+double LavaSolver::implicitHeatIntegrationRow(LavaGridCellNode const &cellNode, double value,
+                                              double const neighborValues[6]) {
+    // No equation if later calculation may cause divide-by-zero error
+    if (cellNode.mass == 0 || cellNode.specificHeat == 0) return 0;
+
+    double faceNodeValues[6] = {0, 0, 0, 0, 0, 0};
+
+    // x-min boundary
+    if (cellNode.location.x == 0) {
+        faceNodeValues[0] = 0;
+    } else {
+        faceNodeValues[0] = value - neighborValues[0];
+    }
 
-        Ax[c] = x[c] + delta_t * pow(h, 3) / (cellNode.mass * cellNode.specificHeat) *
-                       (gridFaceXNode(cellNode.location.x + 1,
-                                      cellNode.location.y,
-                                      cellNode.location.z).thermalConductivity * faceNodeValues[1] -
-                        gridFaceXNode(cellNode.location.x,
-                                      cellNode.location.y,
-                                      cellNode.location.z).thermalConductivity * faceNodeValues[0] +
-                        gridFaceYNode(cellNode.location.x,
-                                      cellNode.location.y + 1,
-                                      cellNode.location.z).thermalConductivity * faceNodeValues[3] -
-                        gridFaceYNode(cellNode.location.x,
-                                      cellNode.location.y,
-                                      cellNode.location.z).thermalConductivity * faceNodeValues[2] +
-                        gridFaceZNode(cellNode.location.x,
-                                      cellNode.location.y,
-                                      cellNode.location.z + 1).thermalConductivity * faceNodeValues[5] -
-                        gridFaceZNode(cellNode.location.x,
-                                      cellNode.location.y,
-                                      cellNode.location.z).thermalConductivity * faceNodeValues[4]);
+    // x-max boundary
+    if (cellNode.location.x == size.x - 1) {
+        faceNodeValues[1] = 0;
+    } else {
+        faceNodeValues[1] = neighborValues[1] - value;
+    }
+
+    // y-min boundary
+    if (cellNode.location.y == 0) {
+        faceNodeValues[2] = 0;
+    } else {
+        faceNodeValues[2] = value - neighborValues[2];
+    }
+
+    // y-max boundary
+    if (cellNode.location.y == size.y - 1) {
+        faceNodeValues[3] = 0;
+    } else {
+        faceNodeValues[3] = neighborValues[3] - value;
+    }
 
+    // z-min boundary
+    if (cellNode.location.z == 0) {
+        faceNodeValues[4] = 0;
+    } else {
+        faceNodeValues[4] = value - neighborValues[4];
     }
 
+    // z-max boundary
+    if (cellNode.location.z == size.z - 1) {
+        faceNodeValues[5] = 0;
+    } else {
+        faceNodeValues[5] = neighborValues[5] - value;
+    }
+
+    return value + delta_t * pow(h, 3) / (cellNode.mass * cellNode.specificHeat) *
+                   (gridFaceXNode(cellNode.location.x + 1,
+                                  cellNode.location.y,
+                                  cellNode.location.z).thermalConductivity * faceNodeValues[1] -
+                    gridFaceXNode(cellNode.location.x,
+                                  cellNode.location.y,
+                                  cellNode.location.z).thermalConductivity * faceNodeValues[0] +
+                    gridFaceYNode(cellNode.location.x,
+                                  cellNode.location.y + 1,
+                                  cellNode.location.z).thermalConductivity * faceNodeValues[3] -
+                    gridFaceYNode(cellNode.location.x,
+                                  cellNode.location.y,
+                                  cellNode.location.z).thermalConductivity * faceNodeValues[2] +
+                    gridFaceZNode(cellNode.location.x,
+                                  cellNode.location.y,
+                                  cellNode.location.z + 1).thermalConductivity * faceNodeValues[5] -
+                    gridFaceZNode(cellNode.location.x,
+                                  cellNode.location.y,
+                                  cellNode.location.z).thermalConductivity * faceNodeValues[4]);
 }
 
-void LavaSolver::implicitPressureIntegrationMatrix(std::vector<double> &Ax, std::vector<double> const &x) {
+double LavaSolver::implicitPressureIntegrationRow(LavaGridCellNode const &cellNode, double value,
+                                                  double const neighborValues[6]) {
+    double faceNodeValues[6] = {0, 0, 0, 0, 0, 0};
 
-    auto numGridCellNodes = gridCellNodes.size();
+    // x-min boundary
+    if (cellNode.location.x == 0) {
+        faceNodeValues[0] = 0;
+    } else {
+        faceNodeValues[0] = value - neighborValues[0];
+    }
 
-    for (auto c = 0; c < numGridCellNodes; c++) {
-        auto const &cellNode = gridCellNodes[c];
+    // x-max boundary
+    if (cellNode.location.x == size.x - 1) {
+        faceNodeValues[1] = 0;
+    } else {
+        faceNodeValues[1] = neighborValues[1] - value;
+    }
 
-        // Continue if later calculation may cause divide-by-zero error
-        if (cellNode.type != INTERIOR || cellNode.mass == 0) {
-            Ax[c] = x[c];
-            continue;
-        }
+    // y-min boundary
+    if (cellNode.location.y == 0) {
+        faceNodeValues[2] = 0;
+    } else {
+        faceNodeValues[2] = value - neighborValues[2];
+    }
 
-        double faceNodeValues[6] = {0, 0, 0, 0, 0, 0};
+    // y-max boundary
+    if (cellNode.location.y == size.y - 1) {
+        faceNodeValues[3] = 0;
+    } else {
+        faceNodeValues[3] = neighborValues[3] - value;
+    }
 
-        // x-min boundary
-        if (cellNode.location.x == 0) {
-            faceNodeValues[0] = 0;
-        } else {
-            faceNodeValues[0] = x[c] - x[getGridCellNodeIndex(cellNode.location.x - 1,
-                                                              cellNode.location.y,
-                                                              cellNode.location.z)];
-        }
+    // z-min boundary
+    if (cellNode.location.z == 0) {
+        faceNodeValues[4] = 0;
+    } else {
+        faceNodeValues[4] = value - neighborValues[4];
+    }
 
-        // x-max boundary
-        if (cellNode.location.x == size.x - 1) {
-            faceNodeValues[1] = 0;
-        } else {
-            faceNodeValues[1] = x[getGridCellNodeIndex(cellNode.location.x + 1,
-                                                       cellNode.location.y,
-                                                       cellNode.location.z)] - x[c];
-        }
+    // z-max boundary
+    if (cellNode.location.z == size.z - 1) {
+        faceNodeValues[5] = 0;
+    } else {
+        faceNodeValues[5] = neighborValues[5] - value;
+    }
 
-        // y-min boundary
-        if (cellNode.location.y == 0) {
-            faceNodeValues[2] = 0;
-        } else {
-            faceNodeValues[2] = x[c] - x[getGridCellNodeIndex(cellNode.location.x,
-                                                              cellNode.location.y - 1,
-                                                              cellNode.location.z)];
-        }
+    return (cellNode.jp * value * cellNode.inv_lambda) / (cellNode.je * delta_t) +
+           delta_t * (gridFaceXNode(cellNode.location.x + 1,
+                                    cellNode.location.y,
+                                    cellNode.location.z).inv_density * faceNodeValues[1] -
+                      gridFaceXNode(cellNode.location.x,
+                                    cellNode.location.y,
+                                    cellNode.location.z).inv_density * faceNodeValues[0] +
+                      gridFaceYNode(cellNode.location.x,
+                                    cellNode.location.y + 1,
+                                    cellNode.location.z).inv_density * faceNodeValues[3] -
+                      gridFaceYNode(cellNode.location.x,
+                                    cellNode.location.y,
+                                    cellNode.location.z).inv_density * faceNodeValues[2] +
+                      gridFaceZNode(cellNode.location.x,
+                                    cellNode.location.y,
+                                    cellNode.location.z + 1).inv_density * faceNodeValues[5] -
+                      gridFaceZNode(cellNode.location.x,
+                                    cellNode.location.y,
+                                    cellNode.location.z).inv_density * faceNodeValues[4]);
+}
 
-        // y-max boundary
-        if (cellNode.location.y == size.y - 1) {
-            faceNodeValues[3] = 0;
-        } else {
-            faceNodeValues[3] = x[getGridCellNodeIndex(cellNode.location.x,
-                                                       cellNode.location.y + 1,
-                                                       cellNode.location.z)] - x[c];
-        }
+void LavaSolver::binParticleNodes() {
+    // Face stencils start at most one node after the cell stencil, so all four fit in the 5 nodes BlockColoring allows
+    rasterizationColoring.bin(size + glm::uvec3(1), particleNodes.size(), [this](unsigned int p) {
+        return glm::ivec3((particleNodes[p].position / h) - glm::dvec3(1));
+    });
+}
 
-        // z-min boundary
-        if (cellNode.location.z == 0) {
-            faceNodeValues[4] = 0;
-        } else {
-            faceNodeValues[4] = x[c] - x[getGridCellNodeIndex(cellNode.location.x,
-                                                              cellNode.location.y,
-                                                              cellNode.location.z - 1)];
-        }
+void LavaSolver::rasterizeParticleNode(unsigned int p) {
+    auto &particleNode = particleNodes[p];
+    auto gcmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1));
+    auto gfxmin = glm::ivec3((particleNode.position / h) - glm::dvec3(0.5, 1, 1));
+    auto gfymin = glm::ivec3((particleNode.position / h) - glm::dvec3(1, 0.5, 1));
+    auto gfzmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1, 1, 0.5));
+
+    double jp = glm::determinant(particleNode.deformPlastic);
+    double je = glm::determinant(particleNode.deformElastic);
+    double j = glm::determinant(particleNode.deformElastic * particleNode.deformPlastic);
+
+    auto const &material = materials[particleNode.material];
+    auto e = exp(material.hardeningCoefficient * (1 - jp));
+    auto mu = material.mu0 * e;
+    auto lambda = material.lambda0 * e;
+    auto inv_lambda = 1 / lambda;
+
+    StencilWeights<CubicBSpline> cellWeights, faceXWeights, faceYWeights, faceZWeights;
+    cellWeights.compute(particleNode.position, gcmin, glm::dvec3(0), h, invh);
+    faceXWeights.compute(particleNode.position, gfxmin, glm::dvec3(-0.5, 0, 0), h, invh);
+    faceYWeights.compute(particleNode.position, gfymin, glm::dvec3(0, -0.5, 0), h, invh);
+    faceZWeights.compute(particleNode.position, gfzmin, glm::dvec3(0, 0, -0.5), h, invh);
+
+    // Nearby weighted grid cell nodes
+    for (unsigned int i = 0; i < 64; i++) {
+        auto gx = gcmin.x + i / 16;
+        auto gy = gcmin.y + (i / 4) % 4;
+        auto gz = gcmin.z + i % 4;
+        if (!isValidGridCellNode(gx, gy, gz)) continue;
+        auto &cellNode = this->gridCellNode(gx, gy, gz);
+
+        // Pre-compute weights
+        particleNode.cell_weight[i] = cellWeights.weight(i);
+        particleNode.cell_nabla_weight[i] = cellWeights.nabla_weight(i);
+
+        auto particleWeightedMass = particleNode.mass * particleNode.cell_weight[i];
+
+        cellNode.mass += particleWeightedMass;
+        cellNode.j += j * particleWeightedMass;
+        cellNode.je += je * particleWeightedMass;
+        cellNode.specificHeat += material.specificHeat * particleWeightedMass;
+        cellNode.temperature += particleNode.temperature * particleWeightedMass;
+        cellNode.inv_lambda += inv_lambda * particleWeightedMass;
+    }
 
-        // z-max boundary
-        if (cellNode.location.z == size.z - 1) {
-            faceNodeValues[5] = 0;
-        } else {
-            faceNodeValues[5] = x[getGridCellNodeIndex(cellNode.location.x,
-                                                       cellNode.location.y,
-                                                       cellNode.location.z + 1)] - x[c];
+    // Nearby weighted grid face nodes
+    for (unsigned int i = 0; i < 64; i++) {
+        auto gx = gfxmin.x + i / 16;
+        auto gy = gfxmin.y + (i / 4) % 4;
+        auto gz = gfxmin.z + i % 4;
+        if (!isValidGridFaceXNode(gx, gy, gz)) continue;
+        auto &faceNode = this->gridFaceXNode(gx, gy, gz);
+
+        // Pre-compute weights
+        particleNode.face_x_weight[i] = faceXWeights.weight(i);
+        particleNode.face_x_nabla_weight[i] = faceXWeights.nabla_weight(i);
+
+        auto particleWeightedMass = particleNode.mass * particleNode.face_x_weight[i];
+
+        faceNode.mass += particleWeightedMass;
+        faceNode.velocity.x += particleNode.velocity.x * particleWeightedMass;
+        faceNode.thermalConductivity += material.thermalConductivity * particleWeightedMass;
+
+        // Control volume of the cell on the max side, if it's in the cell stencil (normalized in step 7)
+        if (gx <= gcmin.x + 3) {
+            faceNode.inv_density += particleNode.face_x_weight[i];
         }
+    }
+    for (unsigned int i = 0; i < 64; i++) {
+        auto gx = gfymin.x + i / 16;
+        auto gy = gfymin.y + (i / 4) % 4;
+        auto gz = gfymin.z + i % 4;
+        if (!isValidGridFaceYNode(gx, gy, gz)) continue;
+        auto &faceNode = this->gridFaceYNode(gx, gy, gz);
+
+        // Pre-compute weights
+        particleNode.face_y_weight[i] = faceYWeights.weight(i);
+        particleNode.face_y_nabla_weight[i] = faceYWeights.nabla_weight(i);
+
+        auto particleWeightedMass = particleNode.mass * particleNode.face_y_weight[i];
 
-        Ax[c] = (cellNode.jp * x[c] * cellNode.inv_lambda) / (cellNode.je * delta_t) +
-                delta_t * (gridFaceXNode(cellNode.location.x + 1,
-                                         cellNode.location.y,
-                                         cellNode.location.z).inv_density * faceNodeValues[1] -
-                           gridFaceXNode(cellNode.location.x,
-                                         cellNode.location.y,
-                                         cellNode.location.z).inv_density * faceNodeValues[0] +
-                           gridFaceYNode(cellNode.location.x,
-                                         cellNode.location.y + 1,
-                                         cellNode.location.z).inv_density * faceNodeValues[3] -
-                           gridFaceYNode(cellNode.location.x,
-                                         cellNode.location.y,
-                                         cellNode.location.z).inv_density * faceNodeValues[2] +
-                           gridFaceZNode(cellNode.location.x,
-                                         cellNode.location.y,
-                                         cellNode.location.z + 1).inv_density * faceNodeValues[5] -
-                           gridFaceZNode(cellNode.location.x,
-                                         cellNode.location.y,
-                                         cellNode.location.z).inv_density * faceNodeValues[4]);
+        faceNode.mass += particleWeightedMass;
+        faceNode.velocity.y += particleNode.velocity.y * particleWeightedMass;
+        faceNode.thermalConductivity += material.thermalConductivity * particleWeightedMass;
 
+        if (gy <= gcmin.y + 3) {
+            faceNode.inv_density += particleNode.face_y_weight[i];
+        }
     }
+    for (unsigned int i = 0; i < 64; i++) {
+        auto gx = gfzmin.x + i / 16;
+        auto gy = gfzmin.y + (i / 4) % 4;
+        auto gz = gfzmin.z + i % 4;
+        if (!isValidGridFaceZNode(gx, gy, gz)) continue;
+        auto &faceNode = this->gridFaceZNode(gx, gy, gz);
+
+        // Pre-compute weights
+        particleNode.face_z_weight[i] = faceZWeights.weight(i);
+        particleNode.face_z_nabla_weight[i] = faceZWeights.nabla_weight(i);
+
+        auto particleWeightedMass = particleNode.mass * particleNode.face_z_weight[i];
+
+        faceNode.mass += particleWeightedMass;
+        faceNode.velocity.z += particleNode.velocity.z * particleWeightedMass;
+        faceNode.thermalConductivity += material.thermalConductivity * particleWeightedMass;
 
+        if (gz <= gcmin.z + 3) {
+            faceNode.inv_density += particleNode.face_z_weight[i];
+        }
+    }
 }
 
 void LavaSolver::saveState(std::string const &filename) {
@@ -1111,35 +1208,51 @@ void LavaSolver::saveState(std::string const &filename) {
     file.open(filename, std::ofstream::binary | std::ofstream::trunc);
 
     LAVA_SOLVER_STATE_HEADER solverStateHeader{
-            'LA',
+            'LM',
             sizeof(LAVA_SOLVER_STATE_HEADER),
             static_cast<float>(h),
             size,
             tick,
             static_cast<float>(delta_t),
             static_cast<float>(alpha),
-            particleNodes.size()
+            particleNodes.size(),
+            materials.size()
     };
 
     file.write(reinterpret_cast<char *>(&solverStateHeader), sizeof(LAVA_SOLVER_STATE_HEADER));
 
+    LAVA_SOLVER_STATE_MATERIAL materialState{};
+    for (auto const &material : materials) {
+        materialState.criticalCompression = material.criticalCompression;
+        materialState.criticalStretch = material.criticalStretch;
+        materialState.hardeningCoefficient = material.hardeningCoefficient;
+        materialState.youngsModulus0 = material.youngsModulus0;
+        materialState.poissonsRatio = material.poissonsRatio;
+        materialState.thermalConductivity = material.thermalConductivity;
+        materialState.specificHeat = material.specificHeat;
+        materialState.fusionTemperature = material.fusionTemperature;
+        materialState.latentHeatOfFusion = material.latentHeatOfFusion;
+
+        file.write(reinterpret_cast<char *>(&materialState), sizeof(LAVA_SOLVER_STATE_MATERIAL));
+    }
+
+    // Particles are written in ID order so that frames line up however the particles are ordered in memory
+    std::vector<unsigned int> particleSlots(particleNodes.size());
+    for (unsigned int p = 0; p < particleNodes.size(); p++) {
+        particleSlots[p < particleIds.size() ? particleIds[p] : p] = p;
+    }
+
     LAVA_SOLVER_STATE_PARTICLE particleState{};
-    for (auto const &particleNode : particleNodes) {
+    for (auto p : particleSlots) {
+        auto const &particleNode = particleNodes[p];
+
         particleState.position = particleNode.position;
         particleState.velocity = particleNode.velocity;
         particleState.mass = particleNode.mass;
         particleState.temperature = particleNode.temperature;
-        particleState.criticalCompression = particleNode.criticalCompression;
-        particleState.criticalStretch = particleNode.criticalStretch;
-        particleState.hardeningCoefficient = particleNode.hardeningCoefficient;
-        particleState.youngsModulus0 = particleNode.youngsModulus0;
-        particleState.poissonsRatio = particleNode.poissonsRatio;
-        particleState.thermalConductivity = particleNode.thermalConductivity;
-        particleState.specificHeat = particleNode.specificHeat;
-        particleState.fusionTemperature = particleNode.fusionTemperature;
-        particleState.latentHeatOfFusion = particleNode.latentHeatOfFusion;
         particleState.latentHeat = particleNode.latentHeat;
         particleState.volume0 = particleNode.volume0;
+        particleState.material = particleNode.material;
         particleState.deformElastic = particleNode.deformElastic;
         particleState.deformPlastic = particleNode.deformPlastic;
 
@@ -1149,6 +1262,27 @@ void LavaSolver::saveState(std::string const &filename) {
     file.close();
 }
 
+// Particle of LA frames, which carry their own material properties
+struct LAVA_SOLVER_STATE_PARTICLE_LA {
+    glm::dvec3 position;
+    glm::dvec3 velocity;
+    float mass;
+    float temperature;
+    float criticalCompression;
+    float criticalStretch;
+    float hardeningCoefficient;
+    float youngsModulus0;
+    float poissonsRatio;
+    float thermalConductivity;
+    float specificHeat;
+    float fusionTemperature;
+    float latentHeatOfFusion;
+    float latentHeat;
+    float volume0;
+    glm::dmat3 deformElastic;
+    glm::dmat3 deformPlastic;
+};
+
 void LavaSolver::loadState(std::string const &filename) {
     std::ifstream file(filename, std::ifstream::binary);
 
@@ -1157,39 +1291,121 @@ void LavaSolver::loadState(std::string const &filename) {
 
     LAVA_SOLVER_STATE_HEADER solverStateHeader{};
     file.read(reinterpret_cast<char *>(&solverStateHeader), sizeof(LAVA_SOLVER_STATE_HEADER));
-    if (solverStateHeader.type != 'LA') {
+    if (solverStateHeader.type != 'LM' && solverStateHeader.type != 'LA') {
         LOG(ERROR) << "Unexpected file type" << std::endl;
         return;
     }
 
+    auto legacy = solverStateHeader.type == 'LA';
+    if (legacy) {
+        // The header has no material count, the particles start right after it
+        solverStateHeader.numMaterials = 0;
+        file.seekg(solverStateHeader.headerSize);
+    }
+
     h = solverStateHeader.h;
     size = solverStateHeader.size;
     tick = solverStateHeader.tick;
     delta_t = solverStateHeader.delta_t;
     alpha = solverStateHeader.alpha;
     particleNodes.resize(solverStateHeader.numParticles, emptyParticleNode);
+    particleIds.clear();
+
+    materials.resize(solverStateHeader.numMaterials);
+
+    LAVA_SOLVER_STATE_MATERIAL materialState{};
+    for (auto &material : materials) {
+        file.read(reinterpret_cast<char *>(&materialState), sizeof(LAVA_SOLVER_STATE_MATERIAL));
+
+        material.criticalCompression = materialState.criticalCompression;
+        material.criticalStretch = materialState.criticalStretch;
+        material.hardeningCoefficient = materialState.hardeningCoefficient;
+        material.youngsModulus0 = materialState.youngsModulus0;
+        material.poissonsRatio = materialState.poissonsRatio;
+        material.thermalConductivity = materialState.thermalConductivity;
+        material.specificHeat = materialState.specificHeat;
+        material.fusionTemperature = materialState.fusionTemperature;
+        material.latentHeatOfFusion = materialState.latentHeatOfFusion;
+    }
 
-    LAVA_SOLVER_STATE_PARTICLE particleState{};
+    if (legacy) {
+        // Gather the distinct material properties of the particles into the table
+        LAVA_SOLVER_STATE_PARTICLE_LA particleState{};
+        for (auto &particleNode : particleNodes) {
+            file.read(reinterpret_cast<char *>(&particleState), sizeof(LAVA_SOLVER_STATE_PARTICLE_LA));
+
+            LavaMaterial material;
+            material.criticalCompression = particleState.criticalCompression;
+            material.criticalStretch = particleState.criticalStretch;
+            material.hardeningCoefficient = particleState.hardeningCoefficient;
+            material.youngsModulus0 = particleState.youngsModulus0;
+            material.poissonsRatio = particleState.poissonsRatio;
+            material.thermalConductivity = particleState.thermalConductivity;
+            material.specificHeat = particleState.specificHeat;
+            material.fusionTemperature = particleState.fusionTemperature;
+            material.latentHeatOfFusion = particleState.latentHeatOfFusion;
+
+            auto m = 0;
+            for (; m < materials.size(); m++) {
+                auto const &other = materials[m];
+                if (other.criticalCompression == material.criticalCompression &&
+                    other.criticalStretch == material.criticalStretch &&
+                    other.hardeningCoefficient == material.hardeningCoefficient &&
+                    other.youngsModulus0 == material.youngsModulus0 &&
+                    other.poissonsRatio == material.poissonsRatio &&
+                    other.thermalConductivity == material.thermalConductivity &&
+                    other.specificHeat == material.specificHeat &&
+                    other.fusionTemperature == material.fusionTemperature &&
+                    other.latentHeatOfFusion == material.latentHeatOfFusion) {
+                    break;
+                }
+            }
+            if (m == materials.size()) {
+                materials.push_back(material);
+            }
+
+            particleNode.position = particleState.position;
+            particleNode.velocity = particleState.velocity;
+            particleNode.mass = particleState.mass;
+            particleNode.temperature = particleState.temperature;
+            particleNode.material = static_cast<unsigned short>(m);
+            particleNode.latentHeat = particleState.latentHeat;
+            particleNode.volume0 = particleState.volume0;
+            particleNode.deformElastic = particleState.deformElastic;
+            particleNode.deformPlastic = particleState.deformPlastic;
+        }
+    } else {
+        LAVA_SOLVER_STATE_PARTICLE particleState{};
+        for (auto &particleNode : particleNodes) {
+            file.read(reinterpret_cast<char *>(&particleState), sizeof(LAVA_SOLVER_STATE_PARTICLE));
+
+            particleNode.position = particleState.position;
+            particleNode.velocity = particleState.velocity;
+            particleNode.mass = particleState.mass;
+            particleNode.temperature = particleState.temperature;
+            particleNode.material = particleState.material;
+            particleNode.latentHeat = particleState.latentHeat;
+            particleNode.volume0 = particleState.volume0;
+            particleNode.deformElastic = particleState.deformElastic;
+            particleNode.deformPlastic = particleState.deformPlastic;
+        }
+    }
+
+    if (materials.empty()) {
+        materials.resize(1);
+    }
+
+    // A corrupt frame may refer past the material table
+    auto numInvalidMaterials = 0;
     for (auto &particleNode : particleNodes) {
-        file.read(reinterpret_cast<char *>(&particleState), sizeof(LAVA_SOLVER_STATE_PARTICLE));
-
-        particleNode.position = particleState.position;
-        particleNode.velocity = particleState.velocity;
-        particleNode.mass = particleState.mass;
-        particleNode.temperature = particleState.temperature;
-        particleNode.criticalCompression = particleState.criticalCompression;
-        particleNode.criticalStretch = particleState.criticalStretch;
-        particleNode.hardeningCoefficient = particleState.hardeningCoefficient;
-        particleNode.youngsModulus0 = particleState.youngsModulus0;
-        particleNode.poissonsRatio = particleState.poissonsRatio;
-        particleNode.thermalConductivity = particleState.thermalConductivity;
-        particleNode.specificHeat = particleState.specificHeat;
-        particleNode.fusionTemperature = particleState.fusionTemperature;
-        particleNode.latentHeatOfFusion = particleState.latentHeatOfFusion;
-        particleNode.latentHeat = particleState.latentHeat;
-        particleNode.volume0 = particleState.volume0;
-        particleNode.deformElastic = particleState.deformElastic;
-        particleNode.deformPlastic = particleState.deformPlastic;
+        if (particleNode.material >= materials.size()) {
+            particleNode.material = 0;
+            numInvalidMaterials++;
+        }
+    }
+    if (numInvalidMaterials > 0) {
+        LOG(ERROR) << "Unexpected material of " << numInvalidMaterials << " particles, reset to material 0"
+                   << std::endl;
     }
 
     file.close();
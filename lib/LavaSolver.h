@@ -4,17 +4,37 @@
 
 #include <vector>
 
+#include "ActiveSet.h"
+#include "BitPlane.h"
+#include "BlockColoring.h"
+#include "CellMultigrid.h"
+#include "LavaMaterial.h"
 #include "LavaParticleNode.h"
 #include "LavaGridCellNode.h"
 #include "LavaGridFaceNode.h"
+#include "RedBlackSOR.h"
 #include "Solver.h"
+#include "conjugate_residual_solver.h"
+#include "StencilMatrix.h"
+#include "StencilWeights.h"
+#include "WarmStartCache.h"
+
+
+// Solvers of the cell systems, all of them run on the matrix assembled once per step
+// NB: Conjugate residual and multigrid expect a symmetric system, the heat system is only diagonally dominant
+enum LinearSolverType {
+    CONJUGATE_RESIDUAL, // Unpreconditioned
+    RED_BLACK_SOR, // Red-black successive over-relaxation sweeps
+    MULTIGRID, // V-cycles of CellMultigrid
+    MULTIGRID_CONJUGATE_RESIDUAL // Conjugate residual preconditioned with a V-cycle
+};
 
 
 class LavaSolver : public Solver {
 public:
 
     struct LAVA_SOLVER_STATE_HEADER {
-        unsigned short type; // LA
+        unsigned short type; // LM, LA for frames with the material properties in each particle
         unsigned int headerSize;
         float h;
         glm::uvec3 size;
@@ -22,6 +42,21 @@ public:
         float delta_t;
         float alpha;
         size_t numParticles;
+        size_t numMaterials; // Not in LA frames
+    };
+
+    // The material table follows the header, then the particles
+
+    struct LAVA_SOLVER_STATE_MATERIAL {
+        double criticalCompression;
+        double criticalStretch;
+        double hardeningCoefficient;
+        double youngsModulus0;
+        double poissonsRatio;
+        double thermalConductivity;
+        double specificHeat;
+        double fusionTemperature;
+        double latentHeatOfFusion;
     };
 
     struct LAVA_SOLVER_STATE_PARTICLE {
@@ -29,17 +64,9 @@ public:
         glm::dvec3 velocity;
         float mass;
         float temperature;
-        float criticalCompression;
-        float criticalStretch;
-        float hardeningCoefficient;
-        float youngsModulus0;
-        float poissonsRatio;
-        float thermalConductivity;
-        float specificHeat;
-        float fusionTemperature;
-        float latentHeatOfFusion;
         float latentHeat;
         float volume0;
+        unsigned short material;
         glm::dmat3 deformElastic;
         glm::dmat3 deformPlastic;
     };
@@ -50,6 +77,10 @@ public:
 
     std::vector<LavaParticleNode> particleNodes;
 
+    std::vector<LavaMaterial> materials; // Indexed by LavaParticleNode::material, water only by default
+
+    std::vector<unsigned int> particleIds; // Stable ID of each particle (its index in saved frames)
+
     void propagateSimulationParametersUpdate();
 
     void update();
@@ -114,6 +145,17 @@ public:
         return gridFaceZNodes[getGridFaceZNodeIndex(location.x, location.y, location.z)];
     }
 
+    /**
+     * Cells of the given type as of the last update, bit z of row x * size.y + y being cell (x, y, z)
+     */
+    BitPlane const &getGridCellNodeMask(LavaGridCellNodeType type) const {
+        return cellTypeMasks[type];
+    }
+
+    bool isGridCellNodeType(unsigned int x, unsigned int y, unsigned int z, LavaGridCellNodeType type) const {
+        return cellTypeMasks[type].test(x * size.y + y, z);
+    }
+
     bool isValidGridCellNode(unsigned int x, unsigned int y, unsigned int z) {
         return x >= 0 && y >= 0 && z >= 0 && x < size.x && y < size.y && z < size.z;
     }
@@ -131,114 +173,83 @@ public:
     }
 
     static double n(double x) {
-        auto absx = std::abs(x);
-        if (absx < 1) {
-            auto x2 = x * x;
-            auto absx3 = x2 * absx;
-            return 0.5 * absx3 - x2 + 2. / 3;
-        } else if (absx < 2) {
-            auto x2 = x * x;
-            auto absx3 = x2 * absx;
-            return -1.0 / 6 * absx3 + x2 - 2 * absx + 4.0 / 3;
-        }
-        return 0;
+        return CubicBSpline::n(x);
     }
 
     static double del_n(double x) {
-        auto absx = std::abs(x);
-        if (absx < 1) {
-            auto x2 = x * x;
-            return (3.0 / 2 * x2 - 2 * absx) * (x < 0 ? -1 : 1);
-        } else if (absx < 2) {
-            auto x2 = x * x;
-            return (-1.0 / 2 * x2 + 2 * absx - 2) * (x < 0 ? -1 : 1);
-        }
-        return 0;
+        return CubicBSpline::del_n(x);
     }
 
     static double tight_n(double x) {
-        auto absx = std::abs(x);
-        if (absx < 0.5) {
-            auto x2 = x * x;
-            return -0.5 * x2 + 3.0 / 4.0;
-        } else if (absx < 1.5) {
-            auto x2 = x * x;
-            return 0.5 * x2 - 3.0 / 2.0 * x * (x < 0 ? -1 : 1) + 9.0 / 8.0;
-        }
-        return 0;
+        return QuadraticBSpline::n(x);
     }
 
     static double tight_del_n(double x) {
-        auto absx = std::abs(x);
-        if (absx < 0.5) {
-            return -2 * x;
-        } else if (absx < 1.5) {
-            return x - 3.0 / 2.0 * (x < 0 ? -1 : 1);
-        }
-        return 0;
+        return QuadraticBSpline::del_n(x);
     }
 
-    static void applyTemperatureDifference(LavaParticleNode &node, double temperatureDifference) {
+    static void applyTemperatureDifference(LavaParticleNode &node, LavaMaterial const &material,
+                                           double temperatureDifference) {
         // Latent heat of fusion for phase change
-        double latentEnergyOfFusion = node.mass * node.latentHeatOfFusion; // [J]
+        double latentEnergyOfFusion = node.mass * material.latentHeatOfFusion; // [J]
 
-        if (node.temperature - FLT_EPSILON > node.fusionTemperature) {
+        if (node.temperature - FLT_EPSILON > material.fusionTemperature) {
             // Fluid
 
             auto newTemperature = node.temperature + temperatureDifference;
-            if (newTemperature - FLT_EPSILON > node.fusionTemperature) {
+            if (newTemperature - FLT_EPSILON > material.fusionTemperature) {
                 // Remain as fluid
                 node.temperature = newTemperature;
             } else {
                 // Freezing
 
                 // Energy due to temperature change after reaching freezing point
-                double joules = node.specificHeat * node.mass * (node.fusionTemperature - newTemperature);
+                double joules = material.specificHeat * node.mass * (material.fusionTemperature - newTemperature);
                 if (joules >= latentEnergyOfFusion) {
                     // Allow phase change
                     node.temperature = newTemperature +
                                        latentEnergyOfFusion / node.mass /
-                                       node.specificHeat; // Compensate for phase change
+                                       material.specificHeat; // Compensate for phase change
                 } else {
                     node.latentHeat = latentEnergyOfFusion - joules;
-                    node.temperature = node.fusionTemperature;
+                    node.temperature = material.fusionTemperature;
                 }
             }
-        } else if (node.temperature + FLT_EPSILON < node.fusionTemperature) {
+        } else if (node.temperature + FLT_EPSILON < material.fusionTemperature) {
             // Solid
 
             auto newTemperature = node.temperature + temperatureDifference;
-            if (newTemperature + FLT_EPSILON < node.fusionTemperature) {
+            if (newTemperature + FLT_EPSILON < material.fusionTemperature) {
                 // Remain as solid
                 node.temperature = newTemperature;
             } else {
                 // Melting
 
                 // Energy due to temperature change before after reaching melting point
-                double joules = node.specificHeat * node.mass * (newTemperature - node.fusionTemperature);
+                double joules = material.specificHeat * node.mass * (newTemperature - material.fusionTemperature);
                 if (joules >= latentEnergyOfFusion) {
                     // Allow phase change
                     node.temperature = newTemperature -
                                        latentEnergyOfFusion / node.mass /
-                                       node.specificHeat; // Compensate for phase change
+                                       material.specificHeat; // Compensate for phase change
                 } else {
                     node.latentHeat = joules;
-                    node.temperature = node.fusionTemperature;
+                    node.temperature = material.fusionTemperature;
                 }
             }
         } else {
             // Melting/freezing
 
-            auto newLatentEnergy = node.latentHeat + node.specificHeat * node.mass * temperatureDifference;
+            auto newLatentEnergy = node.latentHeat + material.specificHeat * node.mass * temperatureDifference;
             if (newLatentEnergy > latentEnergyOfFusion) {
                 // Melted
 
                 node.temperature += (newLatentEnergy - latentEnergyOfFusion) / node.mass /
-                                    node.specificHeat; // Compensate for phase change
+                                    material.specificHeat; // Compensate for phase change
             } else if (newLatentEnergy < 0) {
                 // Frozen
 
-                node.temperature += newLatentEnergy / node.mass / node.specificHeat; // Compensate for phase change
+                node.temperature += newLatentEnergy / node.mass / material.specificHeat; // Compensate for phase change
             } else {
                 // Still in phase-change state
                 node.latentHeat = newLatentEnergy;
@@ -250,6 +261,33 @@ public:
 
     double alpha = 0.95; // PIC/FLIP
 
+    LinearSolverType pressureSolver = CONJUGATE_RESIDUAL;
+    LinearSolverType heatSolver = CONJUGATE_RESIDUAL; // RED_BLACK_SOR converges much faster on the heat system
+
+    // Pressure and heat solve budgets, each stops once ||b - Ax|| < max(absolute, relative * ||b - Ax_0||)
+    int pressureSolveMaxIterations = 300;
+    double pressureSolveRelativeTolerance = 0;
+    double pressureSolveAbsoluteTolerance = std::sqrt(FLT_EPSILON);
+    double pressureSolveRelaxationFactor = 1; // Red-black SOR
+    bool warmStartPressureSolve = false; // Seed the solve with the last tick's pressure instead of the elastic guess
+    int heatSolveMaxIterations = 50;
+    double heatSolveRelativeTolerance = 0;
+    double heatSolveAbsoluteTolerance = std::sqrt(FLT_EPSILON);
+    double heatSolveRelaxationFactor = 1;
+    // Cells without heat capacity (e.g. hot colliding cells) keep their temperature, otherwise they are unknowns
+    // without an equation that conjugate residual lets drift. Only affects CONJUGATE_RESIDUAL, the other solvers leave
+    // rows without an equation as they are
+    bool holdHeatBoundaryTemperature = false;
+
+    // Parallelism
+
+    unsigned int numThreads = 1; // Linear solves and parallel rasterization
+    bool parallelRasterization = false; // Block-colored rasterization, otherwise the serial reference path
+
+    // Particle ordering
+
+    unsigned int sortInterval = 0; // Reorder particles along a Z-order curve every so many ticks, 0 to disable
+
     // Grid
     double h;
     glm::uvec3 size;
@@ -262,6 +300,10 @@ public:
 
     bool simulationParametersDidUpdate = true;
 
+    // Convergence of the last solves
+    ConjugateResidualResult pressureSolveResult;
+    ConjugateResidualResult heatSolveResult;
+
 private:
 
     // Dependent values on simulation parameters
@@ -275,11 +317,60 @@ private:
     std::vector<LavaGridFaceNode> gridFaceYNodes;
     std::vector<LavaGridFaceNode> gridFaceZNodes;
 
+    // Record keeping
+
+    // Filled during rasterization, one plane per face direction
+    BitPlane cellOccupancy; // mass > 0
+    BitPlane faceOccupancy[3]; // mass > 0
+    BitPlane faceColliding[3];
+
+    BitPlane cellTypeMasks[3]; // Indexed by LavaGridCellNodeType
+
+    // Cells the pressure and heat systems are reduced to
+    ActiveSet pressureCellNodes;
+    ActiveSet heatCellNodes;
+
+    WarmStartCache<double> pressureWarmStart; // Pressure of the last solve, per cell
+
+    BlockColoring rasterizationColoring; // Particles binned by their cell stencil for parallel rasterization
+
+    // Matrix and solvers of a cell system, kept across ticks for their workspaces
+    struct CellSystem {
+        StencilMatrix matrix; // Assembled once per step
+        ConjugateResidualSolver<double> crSolver;
+        RedBlackSOR sor;
+        CellMultigrid multigrid;
+    };
+
+    CellSystem pressureSystem;
+    CellSystem heatSystem;
+
     // Helper methods
 
-    void implicitHeatIntegrationMatrix(std::vector<double> &Ax, std::vector<double> const &x);
+    void sortParticleNodes();
+
+    void binParticleNodes();
+
+    // Scatters particle p to the cell and face grids, memoizing its weights
+    void rasterizeParticleNode(unsigned int p);
+
+    // Assembles the matrix of a system reduced to cellNodes, of rows given by integrationRow
+    void assembleCellMatrix(ActiveSet const &cellNodes,
+                            double (LavaSolver::*integrationRow)(LavaGridCellNode const &, double, double const[6]),
+                            StencilMatrix &A);
+
+    // Assembles the system and solves Ax = b with solver, the initial guess is passed in as x
+    ConjugateResidualResult solveCellSystem(CellSystem &system, ActiveSet const &cellNodes,
+                                            double (LavaSolver::*integrationRow)(LavaGridCellNode const &, double,
+                                                                                 double const[6]),
+                                            LinearSolverType solver, int k, double relativeTolerance,
+                                            double absoluteTolerance, double relaxationFactor,
+                                            std::vector<double> &x, std::vector<double> const &b);
+
+    double implicitHeatIntegrationRow(LavaGridCellNode const &cellNode, double value, double const neighborValues[6]);
 
-    void implicitPressureIntegrationMatrix(std::vector<double> &Ax, std::vector<double> const &x);
+    double implicitPressureIntegrationRow(LavaGridCellNode const &cellNode, double value,
+                                          double const neighborValues[6]);
 
     double n(glm::dvec3 const &gridPosition, glm::dvec3 const &particlePosition) {
         return n(invh * (particlePosition.x - gridPosition.x)) *
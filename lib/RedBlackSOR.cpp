@@ -0,0 +1,81 @@
+#include "RedBlackSOR.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+void RedBlackSOR::setup(std::vector<glm::uvec3> const &locations) {
+    colorRows[0].clear();
+    colorRows[1].clear();
+
+    for (auto a = 0; a < locations.size(); a++) {
+        auto const &location = locations[a];
+        colorRows[(location.x + location.y + location.z) % 2].push_back(a);
+    }
+}
+
+void RedBlackSOR::sweep(StencilMatrix const &A, std::vector<double> &x, std::vector<double> const &b, bool reverse) {
+    LOG_ASSERT(A.size() == colorRows[0].size() + colorRows[1].size());
+
+    relax(A, x, b, reverse ? 1 : 0);
+    relax(A, x, b, reverse ? 0 : 1);
+}
+
+ConjugateResidualResult RedBlackSOR::solve(StencilMatrix const &A, std::vector<double> &x,
+                                           std::vector<double> const &b, int k,
+                                           double relativeTolerance, double absoluteTolerance) {
+    LOG_ASSERT(x.size() == b.size() && b.size() == A.size());
+
+    auto n = static_cast<int>(b.size());
+
+    residual.resize(n);
+
+    // NB: Summed in order, so the stopping criteria don't depend on the number of threads either
+    auto computeResidual = [&]() {
+#pragma omp parallel for num_threads(numThreads) schedule(static)
+        for (int a = 0; a < n; a++) {
+            residual[a] = A[a].diagonal != 0 ? b[a] - A.applyRow(a, x) : 0;
+        }
+
+        double dot_r_r = 0;
+        for (auto a = 0; a < n; a++) {
+            dot_r_r += residual[a] * residual[a];
+        }
+
+        return dot_r_r;
+    };
+
+    ConjugateResidualResult result;
+
+    auto dot_r_r = computeResidual();
+    result.initialResidual = std::sqrt(dot_r_r);
+
+    auto tolerance = std::max(absoluteTolerance * absoluteTolerance,
+                              relativeTolerance * relativeTolerance * dot_r_r);
+
+    while (result.iterations < k && dot_r_r >= tolerance) {
+        sweep(A, x, b);
+
+        dot_r_r = computeResidual();
+        result.iterations++;
+    }
+
+    result.finalResidual = std::sqrt(dot_r_r);
+    result.termination = dot_r_r < tolerance ? ConjugateResidualResult::CONVERGED
+                                             : ConjugateResidualResult::MAX_ITERATIONS;
+
+    return result;
+}
+
+void RedBlackSOR::relax(StencilMatrix const &A, std::vector<double> &x, std::vector<double> const &b, int color) {
+    auto const &rows = colorRows[color];
+    auto numRows = static_cast<int>(rows.size());
+
+    // Rows of one color don't depend on each other
+#pragma omp parallel for num_threads(numThreads) schedule(static)
+    for (int i = 0; i < numRows; i++) {
+        auto a = rows[i];
+        if (A[a].diagonal == 0) continue; // No equation
+        x[a] += relaxationFactor * (b[a] - A.applyRow(a, x)) / A[a].diagonal;
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef SNOW_REDBLACKSOR_H
+#define SNOW_REDBLACKSOR_H
+
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "StencilMatrix.h"
+#include "conjugate_residual_solver.h"
+
+
+/**
+ * Red-black successive over-relaxation for 7-point operators on grid cells
+ *
+ * Cells are colored by the parity of x + y + z, so a 7-point stencil only couples cells of different colors: each half
+ * sweep updates all the cells of one color at once, in parallel on numThreads threads, and the result doesn't depend
+ * on the number of threads. relaxationFactor = 1 is Gauss-Seidel.
+ *
+ * Rows with a zero diagonal have no equation: their entries keep their value and are left out of the residual.
+ *
+ * Besides solving, sweeps can smooth within other solvers. A red-black sweep followed by a black-red one is symmetric,
+ * like a symmetric Gauss-Seidel iteration.
+ */
+class RedBlackSOR {
+public:
+
+    double relaxationFactor = 1;
+
+    unsigned int numThreads = 1;
+
+    /**
+     * Colors the rows, row a being the cell at locations[a]
+     */
+    void setup(std::vector<glm::uvec3> const &locations);
+
+    /**
+     * One sweep on Ax = b, red cells first unless reverse
+     */
+    void sweep(StencilMatrix const &A, std::vector<double> &x, std::vector<double> const &b, bool reverse = false);
+
+    /**
+     * Solves Ax = b with up to k sweeps, with the stopping criteria of ConjugateResidualSolver
+     * The initial guess is passed in as x
+     * The result will be written in x
+     */
+    ConjugateResidualResult solve(StencilMatrix const &A, std::vector<double> &x, std::vector<double> const &b, int k,
+                                  double relativeTolerance, double absoluteTolerance);
+
+private:
+
+    std::vector<unsigned int> colorRows[2]; // Red, black
+
+    std::vector<double> residual;
+
+    void relax(StencilMatrix const &A, std::vector<double> &x, std::vector<double> const &b, int color);
+
+};
+
+
+#endif //SNOW_REDBLACKSOR_H
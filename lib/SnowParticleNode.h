@@ -16,9 +16,7 @@ struct SnowParticleNode : public Node {
     glm::dmat3 deformElastic = glm::dmat3(1);
     glm::dmat3 deformPlastic = glm::dmat3(1);
 
-    // Memoized weights for each update
-    double weight[64];
-    glm::dvec3 nabla_weight[64];
+    // NB: Weights for each update are kept by the solver (SnowSolver::particleWeights)
 
 };
 
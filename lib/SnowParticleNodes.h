@@ -0,0 +1,132 @@
+#ifndef SNOW_PARTICLENODES_H
+#define SNOW_PARTICLENODES_H
+
+
+#include <vector>
+
+#include "SnowParticleNode.h"
+#include "morton.h"
+
+
+/**
+ * Snow particles stored as a structure of arrays, one contiguous array per attribute
+ *
+ * The solver streams the attribute arrays it needs directly. Scene and rendering code can keep treating the container
+ * as a vector of SnowParticleNode: operator[] returns a proxy with references to the attributes of one particle.
+ */
+class SnowParticleNodes {
+public:
+
+    struct Ref {
+
+        glm::dvec3 &position;
+        double &mass;
+        glm::dvec3 &velocity;
+        glm::dvec3 &velocity_star;
+        double &volume0;
+        glm::dmat3 &deformElastic;
+        glm::dmat3 &deformPlastic;
+
+        Ref &operator=(SnowParticleNode const &particleNode) {
+            position = particleNode.position;
+            mass = particleNode.mass;
+            velocity = particleNode.velocity;
+            velocity_star = particleNode.velocity_star;
+            volume0 = particleNode.volume0;
+            deformElastic = particleNode.deformElastic;
+            deformPlastic = particleNode.deformPlastic;
+            return *this;
+        }
+
+        operator SnowParticleNode() const {
+            SnowParticleNode particleNode(position, mass);
+            particleNode.velocity = velocity;
+            particleNode.velocity_star = velocity_star;
+            particleNode.volume0 = volume0;
+            particleNode.deformElastic = deformElastic;
+            particleNode.deformPlastic = deformPlastic;
+            return particleNode;
+        }
+
+    };
+
+    std::vector<glm::dvec3> position;
+    std::vector<double> mass;
+    std::vector<glm::dvec3> velocity;
+    std::vector<glm::dvec3> velocity_star;
+    std::vector<double> volume0;
+    std::vector<glm::dmat3> deformElastic;
+    std::vector<glm::dmat3> deformPlastic;
+
+    size_t size() const {
+        return position.size();
+    }
+
+    bool empty() const {
+        return position.empty();
+    }
+
+    void resize(size_t n) {
+        position.resize(n);
+        mass.resize(n);
+        velocity.resize(n);
+        velocity_star.resize(n);
+        volume0.resize(n);
+        deformElastic.resize(n, glm::dmat3(1));
+        deformPlastic.resize(n, glm::dmat3(1));
+    }
+
+    void clear() {
+        resize(0);
+    }
+
+    void reserve(size_t n) {
+        position.reserve(n);
+        mass.reserve(n);
+        velocity.reserve(n);
+        velocity_star.reserve(n);
+        volume0.reserve(n);
+        deformElastic.reserve(n);
+        deformPlastic.reserve(n);
+    }
+
+    void emplace_back(glm::dvec3 const &position, double mass) {
+        push_back(SnowParticleNode(position, mass));
+    }
+
+    void push_back(SnowParticleNode const &particleNode) {
+        resize(size() + 1);
+        (*this)[size() - 1] = particleNode;
+    }
+
+    Ref operator[](size_t p) {
+        return {position[p], mass[p], velocity[p], velocity_star[p], volume0[p], deformElastic[p], deformPlastic[p]};
+    }
+
+    SnowParticleNode operator[](size_t p) const {
+        SnowParticleNode particleNode(position[p], mass[p]);
+        particleNode.velocity = velocity[p];
+        particleNode.velocity_star = velocity_star[p];
+        particleNode.volume0 = volume0[p];
+        particleNode.deformElastic = deformElastic[p];
+        particleNode.deformPlastic = deformPlastic[p];
+        return particleNode;
+    }
+
+    /**
+     * Reorders the particles such that particle i is the former particle order[i]
+     */
+    void reorder(std::vector<unsigned int> const &order) {
+        applyOrder(position, order);
+        applyOrder(mass, order);
+        applyOrder(velocity, order);
+        applyOrder(velocity_star, order);
+        applyOrder(volume0, order);
+        applyOrder(deformElastic, order);
+        applyOrder(deformPlastic, order);
+    }
+
+};
+
+
+#endif //SNOW_PARTICLENODES_H
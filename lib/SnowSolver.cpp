@@ -2,14 +2,8 @@
 
 #include <fstream>
 
-#include <glm/gtc/type_ptr.hpp>
-#include <Dense>
-
-#include "conjugate_residual_solver.h"
-
-
-typedef Eigen::Matrix<double, 3, 3> eigen_matrix3;
-typedef Eigen::Matrix<double, 3, 1> eigen_vector3;
+#include "morton.h"
+#include "svd3.h"
 
 
 SnowSolver::SnowSolver(double h, glm::uvec3 const &size) : h(h), size(size) {
@@ -20,32 +14,32 @@ SnowSolver::SnowSolver(std::string const &filename) {
     loadState(filename);
 }
 
-inline void svd(glm::dmat3 const &m, glm::dmat3 &u, glm::dvec3 &e, glm::dmat3 &v) {
-    Eigen::Map<eigen_matrix3 const> mmap(glm::value_ptr(m));
-    Eigen::Map<eigen_matrix3> umap(glm::value_ptr(u));
-    Eigen::Map<eigen_vector3> emap(glm::value_ptr(e));
-    Eigen::Map<eigen_matrix3> vmap(glm::value_ptr(v));
-
-    Eigen::JacobiSVD<eigen_matrix3, Eigen::NoQRPreconditioner> svd;
-    svd.compute(mmap, Eigen::ComputeFullV | Eigen::ComputeFullU);
-    umap = svd.matrixU();
-    emap = svd.singularValues();
-    vmap = svd.matrixV();
-}
-
 inline glm::dmat3 polarRot(glm::dmat3 const &m) {
     glm::dmat3 u;
     glm::dvec3 e;
     glm::dmat3 v;
-    svd(m, u, e, v);
+    svd3(m, u, e, v);
     return u * glm::transpose(v);
 }
 
+// Particles decomposed together (the particle attributes are contiguous, see svd3)
+static unsigned int const svdBatchSize = 4;
+
+inline void polarRot(unsigned int n, glm::dmat3 const *m, glm::dmat3 *r) {
+    glm::dmat3 u[svdBatchSize];
+    glm::dvec3 e[svdBatchSize];
+    glm::dmat3 v[svdBatchSize];
+    svd3(n, m, u, e, v);
+    for (unsigned int i = 0; i < n; i++) {
+        r[i] = u[i] * glm::transpose(v[i]);
+    }
+}
+
 inline void polarDecompose(glm::dmat3 const &m, glm::dmat3 &r, glm::dmat3 &s) {
     glm::dmat3 u;
     glm::dvec3 e;
     glm::dmat3 v;
-    svd(m, u, e, v);
+    svd3(m, u, e, v);
     r = u * glm::transpose(v);
     s = v * glm::dmat3(e.x, 0, 0, 0, e.y, 0, 0, 0, e.z) * glm::transpose(v);
 }
@@ -57,17 +51,10 @@ void SnowSolver::propagateSimulationParametersUpdate() {
     mu0 = youngsModulus0 / (2 * (1 + poissonsRatio));
     invh = 1 / h;
 
-    gridNodes.clear();
-    for (auto x = 0; x < size.x; x++) {
-        for (auto y = 0; y < size.y; y++) {
-            for (auto z = 0; z < size.z; z++) {
-                gridNodes.emplace_back(glm::dvec3(x, y, z) * h, glm::uvec3(x, y, z));
-            }
-        }
-    }
+    gridNodes.resize(size, h);
+    implicitWarmStart.clear();
 
     LOG(INFO) << "size=" << size << std::endl;
-    LOG(INFO) << "#gridNodes=" << gridNodes.size() << std::endl;
 }
 
 void SnowSolver::update() {
@@ -77,63 +64,75 @@ void SnowSolver::update() {
         propagateSimulationParametersUpdate();
     }
 
-    auto numGridNodes = gridNodes.size();
-    auto numParticleNodes = particleNodes.size();
+    if (sortInterval > 0 && tick % sortInterval == 0) {
+        sortParticleNodes();
+    }
 
     // 1. Rasterize particle data to the grid //////////////////////////////////////////////////////////////////////////
 
     LOG(VERBOSE) << "Step 1" << std::endl;
 
+    allocateGridNodes();
+
+    auto numGridNodes = gridNodes.size();
+    auto numParticleNodes = particleNodes.size();
+
     for (auto i = 0; i < numGridNodes; i++) {
         auto &gridNode = gridNodes[i];
 
         gridNode.mass = 0;
         gridNode.velocity = {};
+        gridNode.velocity_star = {};
+        gridNode.force = {};
+        gridNode.density0 = 0;
 
     }
 
-    double totalGridNodeMass = 0;
+    particleWeights.resize(numParticleNodes);
 
-    for (auto p = 0; p < numParticleNodes; p++) {
-        auto &particleNode = particleNodes[p];
-        auto gmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1));
+    // Once the particle volumes are known (after the first tick), the stress forces of step 3 are scattered in the same
+    // sweep as mass and momentum
+    auto scatterForces = tick > 0;
 
-        // Nearby weighted grid nodes
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gmin.x + i / 16;
-            auto gy = gmin.y + (i / 4) % 4;
-            auto gz = gmin.z + i % 4;
-            if (!isValidGridNode(gx, gy, gz)) continue;
-            auto &gridNode = this->gridNode(gx, gy, gz);
+    if (parallelRasterization) {
 
-            // Pre-compute weights
-            particleNode.weight[i] = weight(gridNode, particleNode);
-            particleNode.nabla_weight[i] = nabla_weight(gridNode, particleNode);
+        binParticleNodes();
 
-            auto particleWeightedMass = particleNode.mass * particleNode.weight[i];
+        rasterizationColoring.forEachParticle(numThreads, [this, scatterForces](unsigned int p) {
+            rasterizeParticleNode(p, scatterForces);
+        });
 
-            gridNode.mass += particleWeightedMass;
-            gridNode.velocity += particleNode.velocity * particleWeightedMass; // Translational momentum
+    } else {
 
-            totalGridNodeMass += particleWeightedMass;
+        for (auto p = 0; p < numParticleNodes; p++) {
+            rasterizeParticleNode(p, scatterForces);
         }
 
     }
 
-    LOG(VERBOSE) << "sum(gridNode.mass)=" << totalGridNodeMass << std::endl;
+    double totalGridNodeMass = 0;
+
+    // Nodes without mass keep zero velocities, the per-node passes below only visit the active ones
+    activeGridNodes.reset(numGridNodes);
 
     for (auto i = 0; i < numGridNodes; i++) {
         auto &gridNode = gridNodes[i];
 
+        if (gridNode.mass <= 0) continue;
+
+        activeGridNodes.insert(i);
+        totalGridNodeMass += gridNode.mass;
+
         // Compute velocity
-        if (glm::length(gridNode.velocity) > 0 && gridNode.mass > 0) {
-            gridNode.velocity /= gridNode.mass;
-        } else {
-            gridNode.velocity = {};
-        }
+        gridNode.velocity /= gridNode.mass;
 
     }
 
+    auto numActiveGridNodes = activeGridNodes.size();
+
+    LOG(VERBOSE) << "sum(gridNode.mass)=" << totalGridNodeMass << " #activeGridNodes=" << numActiveGridNodes
+                 << std::endl;
+
     // 2. Compute particle volumes and densities ///////////////////////////////////////////////////////////////////////
 
     if (tick == 0) {
@@ -142,8 +141,8 @@ void SnowSolver::update() {
 
         double totalDensity = 0;
 
-        for (auto i = 0; i < numGridNodes; i++) {
-            auto &gridNode = gridNodes[i];
+        for (auto a = 0; a < numActiveGridNodes; a++) {
+            auto &gridNode = gridNodes[activeGridNodes[a]];
 
             gridNode.density0 = gridNode.mass / (h * h * h);
             totalDensity += gridNode.density0;
@@ -155,8 +154,8 @@ void SnowSolver::update() {
         totalDensity = 0;
 
         for (auto p = 0; p < numParticleNodes; p++) {
-            auto &particleNode = particleNodes[p];
-            auto gmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1));
+            auto gmin = glm::ivec3((particleNodes.position[p] / h) - glm::dvec3(1));
+            auto const &weights = particleWeights[p];
 
             // Nearby weighted grid nodes
             double particleNodeDensity0 = 0;
@@ -167,11 +166,11 @@ void SnowSolver::update() {
                 if (!isValidGridNode(gx, gy, gz)) continue;
                 auto &gridNode = this->gridNode(gx, gy, gz);
 
-                particleNodeDensity0 += gridNode.density0 * particleNode.weight[i];
+                particleNodeDensity0 += gridNode.density0 * weights.weight(i);
 
             }
 
-            particleNode.volume0 = particleNode.mass / particleNodeDensity0;
+            particleNodes.volume0[p] = particleNodes.mass[p] / particleNodeDensity0;
             totalDensity += particleNodeDensity0;
         }
 
@@ -187,50 +186,47 @@ void SnowSolver::update() {
 
     // 3
 
-    for (auto i = 0; i < numGridNodes; i++) {
-        auto &gridNode = gridNodes[i];
-
-        gridNode.force = glm::dvec3(0, 0, -9.8 * gridNode.mass);
+    if (!scatterForces) {
 
-    }
+        glm::dmat3 polarRotDeformElastic[svdBatchSize];
 
-    for (auto p = 0; p < numParticleNodes; p++) {
-        auto const &particleNode = particleNodes[p];
-        auto gmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1));
+        for (auto p = 0; p < numParticleNodes; p++) {
+            auto gmin = glm::ivec3((particleNodes.position[p] / h) - glm::dvec3(1));
+            auto const &weights = particleWeights[p];
 
-        auto jp = glm::determinant(particleNode.deformPlastic);
-        auto je = glm::determinant(particleNode.deformElastic);
+            // Decompose the next batch of elastic deformation gradients
+            if (p % svdBatchSize == 0) {
+                polarRot(std::min<unsigned int>(svdBatchSize, numParticleNodes - p), &particleNodes.deformElastic[p],
+                         polarRotDeformElastic);
+            }
 
-        auto e = exp(hardeningCoefficient * (1 - jp));
-        auto mu = mu0 * e;
-        auto lambda = lambda0 * e;
+            auto unweightedForce = computeUnweightedForce(p, polarRotDeformElastic[p % svdBatchSize]);
 
-        auto unweightedForce = -particleNode.volume0 *
-                               (2 * mu * (particleNode.deformElastic - polarRot(particleNode.deformElastic)) *
-                                glm::transpose(particleNode.deformElastic) +
-                                glm::dmat3(lambda * (je - 1) * je));
+            // Nearby weighted grid nodes
+            for (unsigned int i = 0; i < 64; i++) {
+                auto gx = gmin.x + i / 16;
+                auto gy = gmin.y + (i / 4) % 4;
+                auto gz = gmin.z + i % 4;
+                if (!isValidGridNode(gx, gy, gz)) continue;
+                auto &gridNode = this->gridNode(gx, gy, gz);
 
-        // Nearby weighted grid nodes
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gmin.x + i / 16;
-            auto gy = gmin.y + (i / 4) % 4;
-            auto gz = gmin.z + i % 4;
-            if (!isValidGridNode(gx, gy, gz)) continue;
-            auto &gridNode = this->gridNode(gx, gy, gz);
+                gridNode.force += unweightedForce * weights.nabla_weight(i);
 
-            gridNode.force += unweightedForce * particleNode.nabla_weight[i];
+            }
 
         }
 
     }
 
-    for (auto i = 0; i < numGridNodes; i++) {
-        auto &gridNode = gridNodes[i];
+    for (auto a = 0; a < numActiveGridNodes; a++) {
+        auto &gridNode = gridNodes[activeGridNodes[a]];
+
+        gridNode.force += glm::dvec3(0, 0, -9.8 * gridNode.mass);
 
         // 4
 
         gridNode.velocity_star = gridNode.velocity;
-        if (glm::length(gridNode.force) > 0 && gridNode.mass > 0) {
+        if (glm::length(gridNode.force) > 0) {
             gridNode.velocity_star += delta_t * gridNode.force / gridNode.mass;
         }
 
@@ -245,24 +241,81 @@ void SnowSolver::update() {
 
     if (beta > 0) {
 
-        std::vector<glm::dvec3> velocity_star(gridNodes.size());
-        std::vector<glm::dvec3> velocity_next(gridNodes.size());
+        // The system is reduced to the active grid nodes, massless nodes keep their (zero) velocity
+
+        std::vector<glm::dvec3> velocity_star(numActiveGridNodes);
+        std::vector<glm::dvec3> velocity_next(numActiveGridNodes);
 
-        for (auto i = 0; i < numGridNodes; i++) {
-            auto &gridNode = gridNodes[i];
+        for (auto a = 0; a < numActiveGridNodes; a++) {
+            auto &gridNode = gridNodes[activeGridNodes[a]];
 
-            velocity_star[i] = gridNodes[i].velocity_star;
-            velocity_next[i] = gridNodes[i].velocity_star;
+            velocity_star[a] = gridNode.velocity_star;
+            velocity_next[a] = gridNode.velocity_star;
 
         }
 
-        conjugateResidualSolver(this, &SnowSolver::implicitVelocityIntegrationMatrix,
-                                velocity_next, velocity_star, 300);
+        // Active nodes change between ticks, the warm start is keyed by grid location
+        auto gridLocationKey = [this](size_t a) {
+            auto const &location = gridNodes[activeGridNodes[a]].location;
+            return (location.x * size.y + location.y) * size.z + location.z;
+        };
 
-        for (auto i = 0; i < numGridNodes; i++) {
-            auto &gridNode = gridNodes[i];
+        std::vector<glm::dvec3> velocity_correction;
 
-            gridNodes[i].velocity_star = velocity_next[i];
+        if (warmStartImplicitSolve) {
+            velocity_correction.assign(numActiveGridNodes, glm::dvec3());
+            implicitWarmStart.load(velocity_correction, gridLocationKey);
+
+            for (auto a = 0; a < numActiveGridNodes; a++) {
+                velocity_next[a] += velocity_correction[a];
+            }
+        }
+
+        velocityCRSolver.numThreads = parallelImplicitSolve ? numThreads : 1;
+
+        // The operator scatters with the rasterization coloring, particles haven't moved since
+        if (parallelImplicitSolve && !parallelRasterization) {
+            binParticleNodes();
+        }
+
+        linearizeImplicitVelocityIntegration();
+
+        velocityCRSolver.relativeTolerance = implicitSolveRelativeTolerance;
+        velocityCRSolver.absoluteTolerance = implicitSolveAbsoluteTolerance;
+
+        auto A = [this](std::vector<glm::dvec3> &Ax, std::vector<glm::dvec3> const &x) {
+            implicitVelocityIntegrationMatrix(Ax, x);
+        };
+
+        if (implicitPreconditioning) {
+            computeImplicitPreconditioner();
+
+            // NB: The implicit matrix is self-adjoint in the mass-weighted inner product
+            implicitSolveResult = velocityCRSolver.solve(A, implicitPreconditioner, velocity_next, velocity_star,
+                                                         implicitSolveMaxIterations, &implicitNodeMasses);
+        } else {
+            implicitSolveResult = velocityCRSolver.solve(A, velocity_next, velocity_star, implicitSolveMaxIterations);
+        }
+
+        LOG(VERBOSE) << "implicitSolveIterations=" << implicitSolveResult.iterations
+                     << " warmStart=" << warmStartImplicitSolve
+                     << " residual=" << implicitSolveResult.initialResidual << "->"
+                     << implicitSolveResult.finalResidual << std::endl;
+
+        if (warmStartImplicitSolve) {
+            for (auto a = 0; a < numActiveGridNodes; a++) {
+                velocity_correction[a] = velocity_next[a] - velocity_star[a];
+            }
+
+            implicitWarmStart.store(velocity_correction, gridLocationKey);
+        } else {
+            implicitWarmStart.clear();
+        }
+
+        for (auto a = 0; a < numActiveGridNodes; a++) {
+            auto &gridNode = gridNodes[activeGridNodes[a]];
+
+            gridNode.velocity_star = velocity_next[a];
 
         }
 
@@ -275,76 +328,98 @@ void SnowSolver::update() {
 
     LOG(VERBOSE) << "Step 7, 8, 9, 10" << std::endl;
 
-    for (auto p = 0; p < numParticleNodes; p++) {
-        auto &particleNode = particleNodes[p];
-        auto gmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1));
+    // NB: Each pass only streams the particle attributes it needs
 
-        // 7
+    G2PStencil stencil;
+    G2PTransfer transfer;
 
-        glm::dmat3 nabla_v{};
+    for (auto p = 0; p < numParticleNodes; p++) {
+        auto &deformElastic = particleNodes.deformElastic[p];
+        auto &deformPlastic = particleNodes.deformPlastic[p];
+        auto gmin = glm::ivec3((particleNodes.position[p] / h) - glm::dvec3(1));
+        auto const &weights = particleWeights[p];
 
-        // Nearby weighted grid nodes
+        // 7, 8
+
+        // Gather nearby grid nodes for the G2P kernel
         for (unsigned int i = 0; i < 64; i++) {
             auto gx = gmin.x + i / 16;
             auto gy = gmin.y + (i / 4) % 4;
             auto gz = gmin.z + i % 4;
-            if (!isValidGridNode(gx, gy, gz)) continue;
-            auto &gridNode = this->gridNode(gx, gy, gz);
+            if (!isValidGridNode(gx, gy, gz)) {
+                for (auto k = 0; k < 3; k++) {
+                    stencil.velocity[k][i] = stencil.velocity_star[k][i] = 0;
+                }
+                continue;
+            }
+            auto const &gridNode = this->gridNode(gx, gy, gz);
 
-            nabla_v += glm::outerProduct(gridNode.velocity_star, particleNode.nabla_weight[i]);
+            for (auto k = 0; k < 3; k++) {
+                stencil.velocity[k][i] = gridNode.velocity[k];
+                stencil.velocity_star[k][i] = gridNode.velocity_star[k];
+            }
 
         }
 
-        glm::dmat3 multiplier = glm::dmat3(1) + delta_t * nabla_v;
+        g2p(g2pKernel, weights, stencil, transfer);
+
+        auto const &nabla_v = transfer.nabla_v;
 
-        glm::dmat3 deform = particleNode.deformElastic * particleNode.deformPlastic;
-        glm::dmat3 deform_prime = multiplier * deform;
-        glm::dmat3 deformElastic_prime = multiplier * particleNode.deformElastic;
+        // 7 (the deformation gradients are split into their elastic and plastic parts in the next pass)
 
-        glm::dmat3 u;
-        glm::dvec3 e;
-        glm::dmat3 v;
-        svd(deformElastic_prime, u, e, v);
-        e = glm::clamp(e, 1 - criticalCompression, 1 + criticalStretch);
+        glm::dmat3 multiplier = glm::dmat3(1) + delta_t * nabla_v;
 
-        particleNode.deformElastic = u * glm::dmat3(e.x, 0, 0, 0, e.y, 0, 0, 0, e.z) * glm::transpose(v);
-        particleNode.deformPlastic =
-                v * glm::dmat3(1 / e.x, 0, 0, 0, 1 / e.y, 0, 0, 0, 1 / e.z) * glm::transpose(u) * deform_prime;
+        glm::dmat3 deform = deformElastic * deformPlastic;
+        deformPlastic = multiplier * deform; // deform_prime
+        deformElastic = multiplier * deformElastic; // deformElastic_prime
 
         // 8
 
-        auto v_pic = glm::dvec3();
-        auto v_flip = particleNode.velocity;
+        particleNodes.velocity_star[p] = (1 - alpha) * transfer.v_pic +
+                                         alpha * (particleNodes.velocity[p] + transfer.delta_v);
 
-        // Nearby weighted grid nodes
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gmin.x + i / 16;
-            auto gy = gmin.y + (i / 4) % 4;
-            auto gz = gmin.z + i % 4;
-            if (!isValidGridNode(gx, gy, gz)) continue;
-            auto &gridNode = this->gridNode(gx, gy, gz);
+    }
 
-            auto w = particleNode.weight[i];
-            auto gv = gridNode.velocity;
-            auto gv1 = gridNode.velocity_star;
+    glm::dmat3 u[svdBatchSize];
+    glm::dvec3 e[svdBatchSize];
+    glm::dmat3 v[svdBatchSize];
 
-            v_pic += gv1 * w;
-            v_flip += (gv1 - gv) * w;
+    for (auto p = 0; p < numParticleNodes; p++) {
+        auto &deformElastic = particleNodes.deformElastic[p];
+        auto &deformPlastic = particleNodes.deformPlastic[p];
+
+        // 7
 
+        // Decompose the next batch of elastic deformation gradients
+        if (p % svdBatchSize == 0) {
+            svd3(std::min<unsigned int>(svdBatchSize, numParticleNodes - p), &deformElastic, u, e, v);
         }
 
-        particleNode.velocity_star = (1 - alpha) * v_pic + alpha * v_flip;
+        auto const &up = u[p % svdBatchSize];
+        auto const &vp = v[p % svdBatchSize];
+        auto ep = clampSingularValues(e[p % svdBatchSize], 1 - criticalCompression, 1 + criticalStretch);
+
+        deformElastic = up * glm::dmat3(ep.x, 0, 0, 0, ep.y, 0, 0, 0, ep.z) * glm::transpose(vp);
+        deformPlastic = vp * glm::dmat3(1 / ep.x, 0, 0, 0, 1 / ep.y, 0, 0, 0, 1 / ep.z) * glm::transpose(up) *
+                        deformPlastic;
+
+    }
+
+    for (auto p = 0; p < numParticleNodes; p++) {
 
         // 9
 
-        if (handleNodeCollisionVelocityUpdate)
+        if (handleNodeCollisionVelocityUpdate) {
+            SnowParticleNode particleNode = particleNodes[p];
             handleNodeCollisionVelocityUpdate(particleNode);
+            particleNodes[p] = particleNode;
+        }
 
-        particleNode.velocity = particleNode.velocity_star;
+        particleNodes.velocity[p] = particleNodes.velocity_star[p];
 
         // 10
 
-        particleNode.position += delta_t * particleNode.velocity;
+        particleNodes.position[p] += delta_t * particleNodes.velocity[p];
 
     }
 
@@ -352,138 +427,140 @@ void SnowSolver::update() {
 
 }
 
-inline double ddot(glm::dmat3 a, glm::dmat3 b) {
-    return a[0][0] * b[0][0] + a[0][1] * b[0][1] + a[0][2] * b[0][2] +
-           a[1][0] * b[1][0] + a[1][1] * b[1][1] + a[1][2] * b[1][2] +
-           a[2][0] * b[2][0] + a[2][1] * b[2][1] + a[2][2] * b[2][2];
-}
+void SnowSolver::sortParticleNodes() {
+    // Particles appended since the last sort are numbered in the order they were added
+    for (auto id = static_cast<unsigned int>(particleIds.size()); id < particleNodes.size(); id++) {
+        particleIds.push_back(id);
+    }
 
-void
-SnowSolver::implicitVelocityIntegrationMatrix(std::vector<glm::dvec3> &Av_next, std::vector<glm::dvec3> const &v_next) {
-    LOG_ASSERT(Av_next.size() == v_next.size() && v_next.size() == gridNodes.size());
+    auto order = mortonOrder(particleNodes.size(), h, [this](unsigned int p) {
+        return particleNodes.position[p];
+    });
 
-    auto numGridNodes = gridNodes.size();
-    auto numParticleNodes = particleNodes.size();
+    particleNodes.reorder(order);
+    applyOrder(particleIds, order);
+}
 
-    // x^n+1
+void SnowSolver::binParticleNodes() {
+    rasterizationColoring.bin(size, particleNodes.size(), [this](unsigned int p) {
+        return glm::ivec3((particleNodes.position[p] / h) - glm::dvec3(1));
+    });
+}
 
-    std::vector<glm::dvec3> x_next(numGridNodes);
+void SnowSolver::allocateGridNodes() {
+    gridNodes.clear();
 
-    for (auto i = 0; i < numGridNodes; i++) {
-        x_next[i] = gridNodes[i].position + delta_t * v_next[i];
+    for (auto const &position : particleNodes.position) {
+        auto gmin = glm::ivec3((position / h) - glm::dvec3(1));
+        gridNodes.touch(gmin, gmin + 3);
     }
 
-    // del_f
+    gridNodes.allocate();
 
-    std::vector<glm::dvec3> del_f(numGridNodes);
+    LOG(VERBOSE) << "#gridNodes=" << gridNodes.size() << std::endl;
+}
 
-    for (auto p = 0; p < numParticleNodes; p++) {
-        auto const &particleNode = particleNodes[p];
-        auto gmin = glm::ivec3((particleNode.position / h) - glm::dvec3(1));
+void SnowSolver::rasterizeParticleNode(unsigned int p, bool scatterForce) {
+    auto const &position = particleNodes.position[p];
+    auto const &velocity = particleNodes.velocity[p];
+    auto mass = particleNodes.mass[p];
+    auto gmin = glm::ivec3((position / h) - glm::dvec3(1));
 
-        // del_deformElastic
+    // Pre-compute weights
+    auto &weights = particleWeights[p];
+    weights.compute(position, gmin, glm::dvec3(0), h, invh);
 
-        glm::dmat3 del_deformElastic{};
+    glm::dmat3 unweightedForce{};
+    if (scatterForce) {
+        unweightedForce = computeUnweightedForce(p, polarRot(particleNodes.deformElastic[p]));
+    }
 
-        // Nearby weighted grid nodes
-        for (unsigned int i = 0; i < 64; i++) {
-            auto gx = gmin.x + i / 16;
-            auto gy = gmin.y + (i / 4) % 4;
-            auto gz = gmin.z + i % 4;
-            if (!isValidGridNode(gx, gy, gz)) continue;
-            auto &gridNode = this->gridNode(gx, gy, gz);
+    // Nearby weighted grid nodes
+    for (unsigned int i = 0; i < 64; i++) {
+        auto gx = gmin.x + i / 16;
+        auto gy = gmin.y + (i / 4) % 4;
+        auto gz = gmin.z + i % 4;
+        if (!isValidGridNode(gx, gy, gz)) continue;
+        auto &gridNode = this->gridNode(gx, gy, gz);
+
+        auto particleWeightedMass = mass * weights.weight(i);
 
-            del_deformElastic += glm::outerProduct(v_next[getGridNodeIndex(gx, gy, gz)],
-                                                   particleNode.nabla_weight[i]);
+        gridNode.mass += particleWeightedMass;
+        gridNode.velocity += velocity * particleWeightedMass; // Translational momentum
 
+        if (scatterForce) {
+            gridNode.force += unweightedForce * weights.nabla_weight(i);
         }
+    }
 
-        del_deformElastic = delta_t * del_deformElastic * particleNode.deformElastic;
+}
 
-        // del_polarRotDeformElastic
+glm::dmat3 SnowSolver::computeUnweightedForce(unsigned int p, glm::dmat3 const &polarRotDeformElastic) {
+    auto const &deformElastic = particleNodes.deformElastic[p];
 
-        glm::dmat3 r, s;
-        polarDecompose(particleNode.deformElastic, r, s);
+    auto jp = glm::determinant(particleNodes.deformPlastic[p]);
+    auto je = glm::determinant(deformElastic);
+
+    auto e = exp(hardeningCoefficient * (1 - jp));
+    auto mu = mu0 * e;
+    auto lambda = lambda0 * e;
+
+    return -particleNodes.volume0[p] *
+           (2 * mu * (deformElastic - polarRotDeformElastic) * glm::transpose(deformElastic) +
+            glm::dmat3(lambda * (je - 1) * je));
+}
+
+void SnowSolver::linearizeImplicitVelocityIntegration() {
+    auto numParticleNodes = particleNodes.size();
+
+    implicitParticleTerms.resize(numParticleNodes);
 
-        auto rtdf_dftr = (glm::transpose(r) * del_deformElastic - glm::transpose(del_deformElastic) * r);
-        auto rtdr = glm::inverse(glm::dmat3(s[0][0] + s[1][1], s[2][1], -s[2][0],
-                                            s[1][2], s[0][0] + s[2][2], s[0][1],
-                                            -s[2][0], s[1][0], s[2][2] + s[1][1])) *
-                    glm::dvec3(rtdf_dftr[1][0], rtdf_dftr[2][0], rtdf_dftr[2][1]);
+#pragma omp parallel for num_threads(parallelImplicitSolve ? numThreads : 1)
+    for (int p = 0; p < static_cast<int>(numParticleNodes); p++) {
+        auto const &deformElastic = particleNodes.deformElastic[p];
+        auto &terms = implicitParticleTerms[p];
 
-        auto del_polarRotDeformElastic =
-                r * glm::dmat3(0, -rtdr.x, -rtdr.y,
-                               rtdr.x, 0, -rtdr.z,
-                               rtdr.y, rtdr.z, 0);
+        glm::dmat3 r, s;
+        polarDecompose(deformElastic, r, s);
 
-        // jp, je, mu, lambda
+        terms.polarRotDeformElastic = r;
+        terms.rtdrSystemInverse = glm::inverse(glm::dmat3(s[0][0] + s[1][1], s[2][1], -s[2][0],
+                                                          s[1][2], s[0][0] + s[2][2], s[0][1],
+                                                          -s[2][0], s[1][0], s[2][2] + s[1][1]));
 
-        auto jp = glm::determinant(particleNode.deformPlastic);
-        auto je = glm::determinant(particleNode.deformElastic);
+        auto jp = glm::determinant(particleNodes.deformPlastic[p]);
+        auto je = glm::determinant(deformElastic);
 
         auto e = exp(hardeningCoefficient * (1 - jp));
-        auto mu = mu0 * e;
-        auto lambda = lambda0 * e;
-
-        auto cofactor_deformElastic = je * glm::transpose(glm::inverse(particleNode.deformElastic));
-
-        // del_je
-        // FIXME: Better variable name?
-
-        // Take Frobenius inner product
-        auto del_je = ddot(cofactor_deformElastic, del_deformElastic);
-
-        // del_cofactor_deformElastic
-
-        auto &cde = cofactor_deformElastic;
-
-        auto del_cofactor_deformElastic = glm::dmat3(
-                ddot(glm::dmat3(0, 0, 0,
-                                0, cde[2][2], -cde[2][1],
-                                0, -cde[1][2], cde[1][1]),
-                     del_deformElastic),
-                ddot(glm::dmat3(0, 0, 0,
-                                -cde[2][2], 0, cde[2][0],
-                                cde[1][2], 0, -cde[1][0]),
-                     del_deformElastic),
-                ddot(glm::dmat3(0, 0, 0,
-                                cde[2][1], -cde[2][0], 0,
-                                -cde[1][1], cde[1][0], 0),
-                     del_deformElastic),
-
-                ddot(glm::dmat3(0, -cde[2][2], cde[2][1],
-                                0, 0, 0,
-                                0, cde[0][2], -cde[0][1]),
-                     del_deformElastic),
-                ddot(glm::dmat3(cde[2][2], 0, -cde[2][0],
-                                0, 0, 0,
-                                -cde[0][2], 0, cde[0][0]),
-                     del_deformElastic),
-                ddot(glm::dmat3(-cde[2][1], cde[2][0], 0,
-                                0, 0, 0,
-                                cde[0][1], -cde[0][0], 0),
-                     del_deformElastic),
-
-                ddot(glm::dmat3(0, cde[1][2], -cde[1][1],
-                                0, -cde[0][2], cde[0][1],
-                                0, 0, 0),
-                     del_deformElastic),
-                ddot(glm::dmat3(-cde[1][2], 0, cde[1][0],
-                                cde[0][2], 0, -cde[0][0],
-                                0, 0, 0),
-                     del_deformElastic),
-                ddot(glm::dmat3(cde[1][1], -cde[1][0], 0,
-                                -cde[0][1], cde[0][0], 0,
-                                0, 0, 0),
-                     del_deformElastic));
-
-        // Accumulate to del_f
-
-        auto unweightedDelForce =
-                -particleNode.volume0 * (2 * mu * (del_deformElastic - del_polarRotDeformElastic) +
-                                         lambda * (cofactor_deformElastic * del_je +
-                                                   (je - 1) * del_cofactor_deformElastic)) *
-                glm::transpose(particleNode.deformElastic);
+        terms.je = je;
+        terms.mu = mu0 * e;
+        terms.lambda = lambda0 * e;
+
+        terms.cofactor_deformElastic = je * glm::transpose(glm::inverse(deformElastic));
+    }
+}
+
+void SnowSolver::computeImplicitPreconditioner() {
+    auto numActiveGridNodes = activeGridNodes.size();
+    auto numParticleNodes = particleNodes.size();
+
+    // Diagonal blocks of del_f, d(del_f_i)/d(v_next_i)
+    std::vector<glm::dmat3> del_f_diagonal(numActiveGridNodes);
+
+    for (auto p = 0; p < numParticleNodes; p++) {
+        auto const &deformElastic = particleNodes.deformElastic[p];
+        auto gmin = glm::ivec3((particleNodes.position[p] / h) - glm::dvec3(1));
+        auto const &weights = particleWeights[p];
+
+        // Unweighted del_f is linear in del_deformElastic, evaluate it on the basis (column a, row k)
+        glm::dmat3 basisDelForce[3][3];
+        for (auto a = 0; a < 3; a++) {
+            for (auto k = 0; k < 3; k++) {
+                glm::dmat3 basis{};
+                basis[a][k] = 1;
+                basisDelForce[a][k] = computeUnweightedDelForce(p, basis);
+            }
+        }
 
         // Nearby weighted grid nodes
         for (unsigned int i = 0; i < 64; i++) {
@@ -491,23 +568,203 @@ SnowSolver::implicitVelocityIntegrationMatrix(std::vector<glm::dvec3> &Av_next,
             auto gy = gmin.y + (i / 4) % 4;
             auto gz = gmin.z + i % 4;
             if (!isValidGridNode(gx, gy, gz)) continue;
-            auto &gridNode = this->gridNode(gx, gy, gz);
+            auto a = activeGridNodes.getCompactIndex(getGridNodeIndex(gx, gy, gz));
+            if (a < 0) continue;
 
-            del_f[getGridNodeIndex(gx, gy, gz)] += unweightedDelForce * particleNode.nabla_weight[i];
+            // With only v_next_i = e_k, del_deformElastic = delta_t * e_k (x) (deformElastic^T nabla_weight)
+            auto nabla_weight = weights.nabla_weight(i);
+            auto g = delta_t * (glm::transpose(deformElastic) * nabla_weight);
 
+            auto &block = del_f_diagonal[a];
+            for (auto k = 0; k < 3; k++) {
+                block[k] += (g.x * basisDelForce[0][k] + g.y * basisDelForce[1][k] + g.z * basisDelForce[2][k]) *
+                            nabla_weight;
+            }
         }
+    }
+
+    // Inverse diagonal blocks of the system, symmetrized. The identity is used where a block isn't positive definite
+    implicitPreconditioner.assign(numActiveGridNodes, glm::dmat3(1));
+    implicitNodeMasses.resize(numActiveGridNodes);
+
+    for (auto a = 0; a < numActiveGridNodes; a++) {
+        auto mass = gridNodes[activeGridNodes[a]].mass;
 
+        implicitNodeMasses[a] = mass;
+
+        auto block = glm::dmat3(1) - beta * delta_t / mass * del_f_diagonal[a];
+        block = 0.5 * (block + glm::transpose(block));
+
+        auto minor1 = block[0][0];
+        auto minor2 = block[0][0] * block[1][1] - block[0][1] * block[1][0];
+        auto minor3 = glm::determinant(block);
+        if (minor1 > 0 && minor2 > 0 && minor3 > 0) {
+            implicitPreconditioner[a] = glm::inverse(block);
+        }
     }
+}
 
-    // Av_next
+inline double ddot(glm::dmat3 a, glm::dmat3 b) {
+    return a[0][0] * b[0][0] + a[0][1] * b[0][1] + a[0][2] * b[0][2] +
+           a[1][0] * b[1][0] + a[1][1] * b[1][1] + a[1][2] * b[1][2] +
+           a[2][0] * b[2][0] + a[2][1] * b[2][1] + a[2][2] * b[2][2];
+}
 
-    for (auto i = 0; i < numGridNodes; i++) {
-        Av_next[i] = v_next[i];
-        if (gridNodes[i].mass > 0) {
-            Av_next[i] -= beta * delta_t * del_f[i] / gridNodes[i].mass;
+glm::dmat3 SnowSolver::computeUnweightedDelForce(unsigned int p, glm::dmat3 const &del_deformElastic) {
+    auto const &deformElastic = particleNodes.deformElastic[p];
+    auto const &terms = implicitParticleTerms[p];
+
+    // del_polarRotDeformElastic
+
+    auto const &r = terms.polarRotDeformElastic;
+
+    auto rtdf_dftr = (glm::transpose(r) * del_deformElastic - glm::transpose(del_deformElastic) * r);
+    auto rtdr = terms.rtdrSystemInverse * glm::dvec3(rtdf_dftr[1][0], rtdf_dftr[2][0], rtdf_dftr[2][1]);
+
+    auto del_polarRotDeformElastic =
+            r * glm::dmat3(0, -rtdr.x, -rtdr.y,
+                           rtdr.x, 0, -rtdr.z,
+                           rtdr.y, rtdr.z, 0);
+
+    // je, mu, lambda
+
+    auto je = terms.je;
+    auto mu = terms.mu;
+    auto lambda = terms.lambda;
+
+    auto const &cofactor_deformElastic = terms.cofactor_deformElastic;
+
+    // del_je
+    // FIXME: Better variable name?
+
+    // Take Frobenius inner product
+    auto del_je = ddot(cofactor_deformElastic, del_deformElastic);
+
+    // del_cofactor_deformElastic
+
+    auto &cde = cofactor_deformElastic;
+
+    auto del_cofactor_deformElastic = glm::dmat3(
+            ddot(glm::dmat3(0, 0, 0,
+                            0, cde[2][2], -cde[2][1],
+                            0, -cde[1][2], cde[1][1]),
+                 del_deformElastic),
+            ddot(glm::dmat3(0, 0, 0,
+                            -cde[2][2], 0, cde[2][0],
+                            cde[1][2], 0, -cde[1][0]),
+                 del_deformElastic),
+            ddot(glm::dmat3(0, 0, 0,
+                            cde[2][1], -cde[2][0], 0,
+                            -cde[1][1], cde[1][0], 0),
+                 del_deformElastic),
+
+            ddot(glm::dmat3(0, -cde[2][2], cde[2][1],
+                            0, 0, 0,
+                            0, cde[0][2], -cde[0][1]),
+                 del_deformElastic),
+            ddot(glm::dmat3(cde[2][2], 0, -cde[2][0],
+                            0, 0, 0,
+                            -cde[0][2], 0, cde[0][0]),
+                 del_deformElastic),
+            ddot(glm::dmat3(-cde[2][1], cde[2][0], 0,
+                            0, 0, 0,
+                            cde[0][1], -cde[0][0], 0),
+                 del_deformElastic),
+
+            ddot(glm::dmat3(0, cde[1][2], -cde[1][1],
+                            0, -cde[0][2], cde[0][1],
+                            0, 0, 0),
+                 del_deformElastic),
+            ddot(glm::dmat3(-cde[1][2], 0, cde[1][0],
+                            cde[0][2], 0, -cde[0][0],
+                            0, 0, 0),
+                 del_deformElastic),
+            ddot(glm::dmat3(cde[1][1], -cde[1][0], 0,
+                            -cde[0][1], cde[0][0], 0,
+                            0, 0, 0),
+                 del_deformElastic));
+
+    // Unweighted del_f
+
+    return -particleNodes.volume0[p] * (2 * mu * (del_deformElastic - del_polarRotDeformElastic) +
+                                        lambda * (cofactor_deformElastic * del_je +
+                                                  (je - 1) * del_cofactor_deformElastic)) *
+           glm::transpose(deformElastic);
+}
+
+void
+SnowSolver::implicitVelocityIntegrationMatrix(std::vector<glm::dvec3> &Av_next, std::vector<glm::dvec3> const &v_next) {
+    LOG_ASSERT(Av_next.size() == v_next.size() && v_next.size() == activeGridNodes.size());
+
+    auto numActiveGridNodes = activeGridNodes.size();
+    auto numParticleNodes = particleNodes.size();
+
+    // del_f
+
+    implicitDelForce.assign(numActiveGridNodes, glm::dvec3(0));
+
+    if (parallelImplicitSolve) {
+
+        rasterizationColoring.forEachParticle(numThreads, [this, &v_next](unsigned int p) {
+            scatterUnweightedDelForce(p, v_next);
+        });
+
+    } else {
+
+        for (auto p = 0; p < numParticleNodes; p++) {
+            scatterUnweightedDelForce(p, v_next);
         }
+
+    }
+
+    // Av_next
+
+#pragma omp parallel for num_threads(parallelImplicitSolve ? numThreads : 1)
+    for (int a = 0; a < static_cast<int>(numActiveGridNodes); a++) {
+        Av_next[a] = v_next[a];
+        Av_next[a] -= beta * delta_t * implicitDelForce[a] / gridNodes[activeGridNodes[a]].mass;
+    }
+
+}
+
+void SnowSolver::scatterUnweightedDelForce(unsigned int p, std::vector<glm::dvec3> const &v_next) {
+    auto const &deformElastic = particleNodes.deformElastic[p];
+    auto gmin = glm::ivec3((particleNodes.position[p] / h) - glm::dvec3(1));
+    auto const &weights = particleWeights[p];
+
+    // del_deformElastic
+
+    glm::dmat3 del_deformElastic{};
+
+    // Nearby weighted grid nodes
+    for (unsigned int i = 0; i < 64; i++) {
+        auto gx = gmin.x + i / 16;
+        auto gy = gmin.y + (i / 4) % 4;
+        auto gz = gmin.z + i % 4;
+        if (!isValidGridNode(gx, gy, gz)) continue;
+        auto a = activeGridNodes.getCompactIndex(getGridNodeIndex(gx, gy, gz));
+        if (a < 0) continue;
+
+        del_deformElastic += glm::outerProduct(v_next[a], weights.nabla_weight(i));
+
     }
 
+    del_deformElastic = delta_t * del_deformElastic * deformElastic;
+
+    auto unweightedDelForce = computeUnweightedDelForce(p, del_deformElastic);
+
+    // Nearby weighted grid nodes
+    for (unsigned int i = 0; i < 64; i++) {
+        auto gx = gmin.x + i / 16;
+        auto gy = gmin.y + (i / 4) % 4;
+        auto gz = gmin.z + i % 4;
+        if (!isValidGridNode(gx, gy, gz)) continue;
+        auto a = activeGridNodes.getCompactIndex(getGridNodeIndex(gx, gy, gz));
+        if (a < 0) continue;
+
+        implicitDelForce[a] += unweightedDelForce * weights.nabla_weight(i);
+
+    }
 }
 
 void SnowSolver::saveState(std::string const &filename) {
@@ -530,8 +787,16 @@ void SnowSolver::saveState(std::string const &filename) {
 
     file.write(reinterpret_cast<char *>(&solverStateHeader), sizeof(SNOW_SOLVER_STATE_HEADER));
 
+    // Particles are written in ID order so that frames line up however the particles are ordered in memory
+    std::vector<unsigned int> particleSlots(particleNodes.size());
+    for (unsigned int p = 0; p < particleNodes.size(); p++) {
+        particleSlots[p < particleIds.size() ? particleIds[p] : p] = p;
+    }
+
     SNOW_SOLVER_STATE_PARTICLE particleState{};
-    for (auto const &particleNode : particleNodes) {
+    for (auto p : particleSlots) {
+        auto const &particleNode = particleNodes[p];
+
         particleState.position = particleNode.position;
         particleState.velocity = particleNode.velocity;
         particleState.mass = particleNode.mass;
@@ -548,9 +813,6 @@ void SnowSolver::saveState(std::string const &filename) {
 void SnowSolver::loadState(std::string const &filename) {
     std::ifstream file(filename, std::ifstream::binary);
 
-    SnowParticleNode emptyParticleNode{{},
-                                       {}};
-
     SNOW_SOLVER_STATE_HEADER solverStateHeader{};
     file.read(reinterpret_cast<char *>(&solverStateHeader), sizeof(SNOW_SOLVER_STATE_HEADER));
     youngsModulus0 = solverStateHeader.youngsModulus0;
@@ -563,10 +825,12 @@ void SnowSolver::loadState(std::string const &filename) {
     delta_t = solverStateHeader.delta_t;
     alpha = solverStateHeader.alpha;
     beta = solverStateHeader.beta;
-    particleNodes.resize(solverStateHeader.numParticles, emptyParticleNode);
+    particleNodes.resize(solverStateHeader.numParticles);
+    particleIds.clear();
 
     SNOW_SOLVER_STATE_PARTICLE particleState{};
-    for (auto &particleNode : particleNodes) {
+    for (unsigned int p = 0; p < particleNodes.size(); p++) {
+        auto particleNode = particleNodes[p];
         file.read(reinterpret_cast<char *>(&particleState), sizeof(SNOW_SOLVER_STATE_PARTICLE));
 
         particleNode.position = particleState.position;
@@ -4,9 +4,16 @@
 
 #include <vector>
 
-#include "SnowParticleNode.h"
+#include "ActiveSet.h"
+#include "SnowParticleNodes.h"
 #include "SnowGridNode.h"
 #include "Solver.h"
+#include "BlockColoring.h"
+#include "conjugate_residual_solver.h"
+#include "SparseGrid.h"
+#include "StencilWeights.h"
+#include "WarmStartCache.h"
+#include "g2p.h"
 
 
 class SnowSolver : public Solver {
@@ -39,7 +46,9 @@ public:
 
     explicit SnowSolver(std::string const &filename);
 
-    std::vector<SnowParticleNode> particleNodes;
+    SnowParticleNodes particleNodes; // Structure of arrays, particleNodes[p] gives a SnowParticleNode-like view
+
+    std::vector<unsigned int> particleIds; // Stable ID of each particle (its index in saved frames)
 
     void propagateSimulationParametersUpdate();
 
@@ -59,12 +68,14 @@ public:
         return tick * delta_t;
     }
 
+    // NB: Grid nodes are only allocated around particles, see allocateGridNodes()
+
     unsigned int getGridNodeIndex(unsigned int x, unsigned int y, unsigned int z) {
-        return (x * size.y + y) * size.z + z;
+        return gridNodes.getNodeIndex(x, y, z);
     }
 
     SnowGridNode &gridNode(unsigned int x, unsigned int y, unsigned int z) {
-        return gridNodes[getGridNodeIndex(x, y, z)];
+        return gridNodes.node(x, y, z);
     }
 
     SnowGridNode &gridNode(glm::uvec3 location) {
@@ -76,29 +87,11 @@ public:
     }
 
     static double n(double x) {
-        auto absx = std::abs(x);
-        if (absx < 1) {
-            auto x2 = x * x;
-            auto absx3 = x2 * absx;
-            return 0.5 * absx3 - x2 + 2. / 3;
-        } else if (absx < 2) {
-            auto x2 = x * x;
-            auto absx3 = x2 * absx;
-            return -1.0 / 6 * absx3 + x2 - 2 * absx + 4.0 / 3;
-        }
-        return 0;
+        return CubicBSpline::n(x);
     }
 
     static double del_n(double x) {
-        auto absx = std::abs(x);
-        if (absx < 1) {
-            auto x2 = x * x;
-            return (3.0 / 2 * x2 - 2 * absx) * (x < 0 ? -1 : 1);
-        } else if (absx < 2) {
-            auto x2 = x * x;
-            return (-1.0 / 2 * x2 + 2 * absx - 2) * (x < 0 ? -1 : 1);
-        }
-        return 0;
+        return CubicBSpline::del_n(x);
     }
 
     // Physical parameters
@@ -132,6 +125,27 @@ public:
 
     double alpha = 0.95; // PIC/FLIP
     double beta = 0; // {explicit = 0, semi-implicit = 1} integration
+    bool implicitPreconditioning = true; // Block-Jacobi preconditioned semi-implicit solve
+
+    // Semi-implicit solve budget, it stops once ||b - Ax|| < max(absolute, relative * ||b - Ax_0||)
+    int implicitSolveMaxIterations = 300;
+    double implicitSolveRelativeTolerance = 0;
+    double implicitSolveAbsoluteTolerance = std::sqrt(FLT_EPSILON);
+    bool warmStartImplicitSolve = false; // Seed the solve with the last tick's velocity correction
+
+    // Parallelism
+
+    unsigned int numThreads = 1;
+    bool parallelRasterization = false; // Block-colored rasterization, otherwise the serial reference path
+    bool parallelImplicitSolve = false; // Block-colored operator and chunked reductions, otherwise the serial path
+
+    // Vectorization
+
+    G2PKernel g2pKernel = getG2PKernel(); // Grid-to-particle kernel, the best one supported by the CPU by default
+
+    // Particle ordering
+
+    unsigned int sortInterval = 0; // Reorder particles along a Z-order curve every so many ticks, 0 to disable
 
     // Grid
     double h;
@@ -145,6 +159,8 @@ public:
 
     bool simulationParametersDidUpdate = true;
 
+    ConjugateResidualResult implicitSolveResult; // Convergence of the last semi-implicit solve
+
 private:
 
     double poissonsRatio = 0.2;
@@ -154,10 +170,58 @@ private:
     double lambda0;
     double mu0;
     double invh;
-    std::vector<SnowGridNode> gridNodes;
+    SparseGrid<SnowGridNode> gridNodes;
+
+    // Record keeping
+
+    BlockColoring rasterizationColoring;
+
+    ConjugateResidualSolver<glm::dvec3> velocityCRSolver; // Keeps its workspace across ticks
+
+    WarmStartCache<glm::dvec3> implicitWarmStart; // v_next - v_star of the last semi-implicit solve, per grid location
+
+    ActiveSet activeGridNodes; // Grid nodes with mass in the current update, the implicit system is reduced to them
+
+    // Memoized weights for each update, per-axis factors of each particle's stencil (reused across ticks)
+    std::vector<StencilWeights<CubicBSpline>> particleWeights;
+
+    // Factors of the implicit matrix that only depend on the particle state, computed once per update
+    struct ImplicitParticleTerms {
+        glm::dmat3 polarRotDeformElastic;
+        glm::dmat3 rtdrSystemInverse; // Inverse of the system solved for R^T del_R
+        glm::dmat3 cofactor_deformElastic;
+        double je;
+        double mu;
+        double lambda;
+    };
+
+    std::vector<ImplicitParticleTerms> implicitParticleTerms;
+
+    std::vector<glm::dmat3> implicitPreconditioner; // Inverse diagonal blocks of the implicit matrix (per active node)
+    std::vector<double> implicitNodeMasses; // Weights of the inner product the implicit matrix is self-adjoint in
+
+    std::vector<glm::dvec3> implicitDelForce; // del_f of the current operator apply
 
     // Helper methods
 
+    void sortParticleNodes();
+
+    void binParticleNodes();
+
+    void allocateGridNodes();
+
+    void rasterizeParticleNode(unsigned int p, bool scatterForce);
+
+    glm::dmat3 computeUnweightedForce(unsigned int p, glm::dmat3 const &polarRotDeformElastic);
+
+    void linearizeImplicitVelocityIntegration();
+
+    glm::dmat3 computeUnweightedDelForce(unsigned int p, glm::dmat3 const &del_deformElastic);
+
+    void computeImplicitPreconditioner();
+
+    void scatterUnweightedDelForce(unsigned int p, std::vector<glm::dvec3> const &v_next);
+
     void implicitVelocityIntegrationMatrix(std::vector<glm::dvec3> &Ax, std::vector<glm::dvec3> const &x);
 
     double n(glm::dvec3 const &gridPosition, glm::dvec3 const &particlePosition) {
@@ -172,7 +236,7 @@ private:
     }
 
     double n(unsigned i, unsigned p) {
-        auto const &ppos = particleNodes[p].position;
+        auto const &ppos = particleNodes.position[p];
         return n(i, ppos);
     }
 
@@ -0,0 +1,192 @@
+#ifndef SNOW_SPARSEGRID_H
+#define SNOW_SPARSEGRID_H
+
+
+#include <algorithm>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "logging.h"
+
+
+/**
+ * Grid of nodes stored in 4x4x4 blocks that are only allocated where they are touched
+ *
+ * Each step the blocks in use are marked with touch() and laid out with allocate(). Allocated nodes are stored
+ * contiguously (block by block, in block order) and can be iterated by index like a dense vector. Released storage
+ * is kept for reuse, so memory scales with the largest occupied volume rather than with the grid size.
+ *
+ * T is constructed from (position, location) like the dense grid nodes.
+ */
+template<typename T>
+class SparseGrid {
+public:
+
+    static unsigned int const blockSize = 4;
+
+    static unsigned int const blockNumNodes = blockSize * blockSize * blockSize;
+
+    void resize(glm::uvec3 const &size, double h) {
+        gridSize = size;
+        this->h = h;
+
+        numBlocks = (size + glm::uvec3(blockSize - 1)) / blockSize;
+        blockSlots.assign(numBlocks.x * numBlocks.y * numBlocks.z, -1);
+        blockTouched.assign(blockSlots.size(), false);
+
+        nodes.clear();
+        slotBlocks.clear();
+        numAllocatedBlocks = 0;
+    }
+
+    /**
+     * Releases all blocks
+     */
+    void clear() {
+        std::fill(blockSlots.begin(), blockSlots.end(), -1);
+        std::fill(blockTouched.begin(), blockTouched.end(), false);
+        numAllocatedBlocks = 0;
+    }
+
+    /**
+     * Marks the blocks overlapping the node range [min, max] (clipped to the grid) to be allocated
+     */
+    void touch(glm::ivec3 const &min, glm::ivec3 const &max) {
+        auto last = glm::ivec3(gridSize) - 1;
+        if (max.x < 0 || max.y < 0 || max.z < 0 || min.x > last.x || min.y > last.y || min.z > last.z) return;
+
+        auto bmin = glm::max(min, glm::ivec3(0)) / static_cast<int>(blockSize);
+        auto bmax = glm::min(max, last) / static_cast<int>(blockSize);
+
+        for (auto bx = bmin.x; bx <= bmax.x; bx++) {
+            for (auto by = bmin.y; by <= bmax.y; by++) {
+                for (auto bz = bmin.z; bz <= bmax.z; bz++) {
+                    blockTouched[(bx * numBlocks.y + by) * numBlocks.z + bz] = true;
+                }
+            }
+        }
+    }
+
+    /**
+     * Assigns storage to the touched blocks, in block order
+     */
+    void allocate() {
+        numAllocatedBlocks = 0;
+
+        for (unsigned int bx = 0; bx < numBlocks.x; bx++) {
+            for (unsigned int by = 0; by < numBlocks.y; by++) {
+                for (unsigned int bz = 0; bz < numBlocks.z; bz++) {
+                    auto b = (bx * numBlocks.y + by) * numBlocks.z + bz;
+                    if (!blockTouched[b]) {
+                        blockSlots[b] = -1;
+                        continue;
+                    }
+
+                    auto slot = numAllocatedBlocks++;
+                    blockSlots[b] = slot;
+                    assignSlot(slot, glm::uvec3(bx, by, bz));
+                }
+            }
+        }
+    }
+
+    size_t size() const {
+        return numAllocatedBlocks * blockNumNodes;
+    }
+
+    unsigned int getNumAllocatedBlocks() const {
+        return numAllocatedBlocks;
+    }
+
+    bool isAllocated(unsigned int x, unsigned int y, unsigned int z) const {
+        return blockSlots[getBlockIndex(x, y, z)] >= 0;
+    }
+
+    /**
+     * Index of a node of an allocated block
+     */
+    unsigned int getNodeIndex(unsigned int x, unsigned int y, unsigned int z) const {
+        auto slot = blockSlots[getBlockIndex(x, y, z)];
+        LOG_ASSERT(slot >= 0); // Not allocated
+
+        return slot * blockNumNodes + getBlockNodeIndex(x, y, z);
+    }
+
+    /**
+     * Node at (x, y, z), or outside the allocated blocks a shared node in its initial state (like an untouched node of
+     * a dense grid), which is reset on every such access so writes to it are discarded
+     */
+    T &node(unsigned int x, unsigned int y, unsigned int z) {
+        auto slot = blockSlots[getBlockIndex(x, y, z)];
+        if (slot < 0) {
+            auto location = glm::uvec3(x, y, z);
+            unallocatedNode.clear();
+            unallocatedNode.emplace_back(glm::dvec3(location) * h, location);
+            return unallocatedNode[0];
+        }
+
+        return nodes[slot * blockNumNodes + getBlockNodeIndex(x, y, z)];
+    }
+
+    T &operator[](size_t i) {
+        return nodes[i];
+    }
+
+    T const &operator[](size_t i) const {
+        return nodes[i];
+    }
+
+private:
+
+    glm::uvec3 gridSize;
+    double h;
+
+    glm::uvec3 numBlocks;
+
+    std::vector<int> blockSlots; // Storage slot of each block, -1 if not allocated
+    std::vector<bool> blockTouched;
+
+    std::vector<T> nodes;
+    std::vector<glm::uvec3> slotBlocks; // Block last stored in each slot
+    unsigned int numAllocatedBlocks = 0;
+
+    std::vector<T> unallocatedNode; // Returned by node() outside the allocated blocks
+
+    unsigned int getBlockIndex(unsigned int x, unsigned int y, unsigned int z) const {
+        return ((x / blockSize) * numBlocks.y + y / blockSize) * numBlocks.z + z / blockSize;
+    }
+
+    // Index of a node within its block
+    unsigned int getBlockNodeIndex(unsigned int x, unsigned int y, unsigned int z) const {
+        return ((x % blockSize) * blockSize + y % blockSize) * blockSize + z % blockSize;
+    }
+
+    void assignSlot(unsigned int slot, glm::uvec3 const &block) {
+        if (slot < slotBlocks.size() && slotBlocks[slot] == block) return; // Nodes already in place
+
+        for (unsigned int i = 0; i < blockNumNodes; i++) {
+            auto location = block * blockSize +
+                            glm::uvec3(i / (blockSize * blockSize), (i / blockSize) % blockSize, i % blockSize);
+            auto position = glm::dvec3(location) * h;
+
+            if (slot < slotBlocks.size()) {
+                auto &node = nodes[slot * blockNumNodes + i];
+                node.position = position;
+                node.location = location;
+            } else {
+                nodes.emplace_back(position, location);
+            }
+        }
+
+        if (slot < slotBlocks.size()) {
+            slotBlocks[slot] = block;
+        } else {
+            slotBlocks.push_back(block);
+        }
+    }
+
+};
+
+
+#endif //SNOW_SPARSEGRID_H
@@ -0,0 +1,82 @@
+#ifndef SNOW_STENCILMATRIX_H
+#define SNOW_STENCILMATRIX_H
+
+
+#include <cstddef>
+#include <vector>
+
+
+/**
+ * Sparse matrix of a 7-point operator on a set of grid cells
+ *
+ * Row a holds the diagonal and, for each neighbor direction (-x, +x, -y, +y, -z, +z), the row of the neighbor cell
+ * (-1 if it isn't in the set) and its coefficient. Rows have a fixed width, so applying the matrix is a single pass
+ * with no indirection besides the neighbor rows.
+ */
+class StencilMatrix {
+public:
+
+    static int const numNeighbors = 6;
+
+    struct Row {
+        double diagonal;
+        int neighbors[numNeighbors];
+        double coefficients[numNeighbors];
+    };
+
+    /**
+     * Sets the size to numRows rows, with no neighbors and a zero diagonal
+     */
+    void reset(size_t numRows) {
+        Row row;
+        row.diagonal = 0;
+        for (auto k = 0; k < numNeighbors; k++) {
+            row.neighbors[k] = -1;
+            row.coefficients[k] = 0;
+        }
+
+        rows.assign(numRows, row);
+    }
+
+    size_t size() const {
+        return rows.size();
+    }
+
+    Row &operator[](size_t a) {
+        return rows[a];
+    }
+
+    Row const &operator[](size_t a) const {
+        return rows[a];
+    }
+
+    double applyRow(size_t a, std::vector<double> const &x) const {
+        auto const &row = rows[a];
+
+        auto result = row.diagonal * x[a];
+        for (auto k = 0; k < numNeighbors; k++) {
+            if (row.neighbors[k] >= 0) {
+                result += row.coefficients[k] * x[row.neighbors[k]];
+            }
+        }
+
+        return result;
+    }
+
+    /**
+     * Ax = A * x
+     */
+    void apply(std::vector<double> &Ax, std::vector<double> const &x) const {
+        for (size_t a = 0; a < rows.size(); a++) {
+            Ax[a] = applyRow(a, x);
+        }
+    }
+
+private:
+
+    std::vector<Row> rows;
+
+};
+
+
+#endif //SNOW_STENCILMATRIX_H
@@ -0,0 +1,116 @@
+#ifndef SNOW_STENCILWEIGHTS_H
+#define SNOW_STENCILWEIGHTS_H
+
+
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+
+// Cubic B-spline
+struct CubicBSpline {
+
+    static double n(double x) {
+        auto absx = std::abs(x);
+        if (absx < 1) {
+            auto x2 = x * x;
+            auto absx3 = x2 * absx;
+            return 0.5 * absx3 - x2 + 2. / 3;
+        } else if (absx < 2) {
+            auto x2 = x * x;
+            auto absx3 = x2 * absx;
+            return -1.0 / 6 * absx3 + x2 - 2 * absx + 4.0 / 3;
+        }
+        return 0;
+    }
+
+    static double del_n(double x) {
+        auto absx = std::abs(x);
+        if (absx < 1) {
+            auto x2 = x * x;
+            return (3.0 / 2 * x2 - 2 * absx) * (x < 0 ? -1 : 1);
+        } else if (absx < 2) {
+            auto x2 = x * x;
+            return (-1.0 / 2 * x2 + 2 * absx - 2) * (x < 0 ? -1 : 1);
+        }
+        return 0;
+    }
+
+};
+
+// Quadratic B-spline ("tight" kernel)
+struct QuadraticBSpline {
+
+    static double n(double x) {
+        auto absx = std::abs(x);
+        if (absx < 0.5) {
+            auto x2 = x * x;
+            return -0.5 * x2 + 3.0 / 4.0;
+        } else if (absx < 1.5) {
+            auto x2 = x * x;
+            return 0.5 * x2 - 3.0 / 2.0 * x * (x < 0 ? -1 : 1) + 9.0 / 8.0;
+        }
+        return 0;
+    }
+
+    static double del_n(double x) {
+        auto absx = std::abs(x);
+        if (absx < 0.5) {
+            return -2 * x;
+        } else if (absx < 1.5) {
+            return x - 3.0 / 2.0 * (x < 0 ? -1 : 1);
+        }
+        return 0;
+    }
+
+};
+
+/**
+ * Weights of a particle over the Width x Width x Width stencil of grid nodes starting at gmin
+ *
+ * The kernel is separable, so only Width values of n and del_n are evaluated per axis and the weights and weight
+ * gradients are built as tensor products. Stencil node i is at gmin + (i / Width^2, (i / Width) % Width, i % Width),
+ * offset by offset (in grid nodes) for staggered grids, e.g. (-0.5, 0, 0) for x-faces.
+ *
+ * The cubic B-spline is nonzero on 4 nodes per axis, from gmin = floor(x - offset) - 1 on. The quadratic one only needs
+ * Width = 3, from gmin = floor(x - offset - 0.5) on, i.e. 27 nodes instead of 64.
+ */
+template<typename Kernel, unsigned int Width = 4>
+struct StencilWeights {
+
+    static unsigned int const width = Width;
+    static unsigned int const numNodes = Width * Width * Width;
+
+    double n[3][Width];
+    double del_n[3][Width];
+
+    double invh;
+
+    void compute(glm::dvec3 const &position, glm::ivec3 const &gmin, glm::dvec3 const &offset, double h,
+                 double invh) {
+        this->invh = invh;
+
+        for (int a = 0; a < 3; a++) {
+            for (int k = 0; k < static_cast<int>(Width); k++) {
+                auto x = invh * (position[a] - (gmin[a] + k + offset[a]) * h);
+                n[a][k] = Kernel::n(x);
+                del_n[a][k] = Kernel::del_n(x);
+            }
+        }
+    }
+
+    double weight(unsigned int i) const {
+        return n[0][i / (Width * Width)] * n[1][(i / Width) % Width] * n[2][i % Width];
+    }
+
+    glm::dvec3 nabla_weight(unsigned int i) const {
+        auto nx = n[0][i / (Width * Width)], ny = n[1][(i / Width) % Width], nz = n[2][i % Width];
+        auto dnx = del_n[0][i / (Width * Width)], dny = del_n[1][(i / Width) % Width], dnz = del_n[2][i % Width];
+
+        return invh * glm::dvec3(dnx * ny * nz, nx * dny * nz, nx * ny * dnz);
+    }
+
+};
+
+
+#endif //SNOW_STENCILWEIGHTS_H
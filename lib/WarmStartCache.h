@@ -0,0 +1,77 @@
+#ifndef SNOW_WARMSTARTCACHE_H
+#define SNOW_WARMSTARTCACHE_H
+
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Last solution of a linear system reduced to a set of grid nodes, to seed the next solve with
+ *
+ * Entries are keyed by a stable identifier of their node (e.g. its linear index in the dense grid), so the solution
+ * can be remapped onto the next tick's set of nodes when nodes become active or inactive.
+ */
+template<typename V>
+class WarmStartCache {
+public:
+
+    void clear() {
+        entries.clear();
+    }
+
+    bool empty() const {
+        return entries.empty();
+    }
+
+    /**
+     * Records x, entry a being the value at the node key(a)
+     */
+    template<typename K>
+    void store(std::vector<V> const &x, K const &key) {
+        entries.resize(x.size());
+
+        for (size_t a = 0; a < x.size(); a++) {
+            entries[a] = std::make_pair(key(a), x[a]);
+        }
+
+        std::sort(entries.begin(), entries.end(), [](Entry const &e0, Entry const &e1) {
+            return e0.first < e1.first;
+        });
+    }
+
+    /**
+     * Writes the recorded value of node key(a) in x[a], entries of nodes that weren't recorded are left untouched
+     * Returns the number of entries written
+     */
+    template<typename K>
+    size_t load(std::vector<V> &x, K const &key) const {
+        size_t numLoaded = 0;
+
+        for (size_t a = 0; a < x.size(); a++) {
+            auto k = key(a);
+            auto it = std::lower_bound(entries.begin(), entries.end(), k, [](Entry const &e, unsigned int k) {
+                return e.first < k;
+            });
+
+            if (it != entries.end() && it->first == k) {
+                x[a] = it->second;
+                numLoaded++;
+            }
+        }
+
+        return numLoaded;
+    }
+
+private:
+
+    typedef std::pair<unsigned int, V> Entry;
+
+    std::vector<Entry> entries; // Sorted by key
+
+};
+
+
+#endif //SNOW_WARMSTARTCACHE_H
@@ -2,6 +2,9 @@
 #define SNOW_CONJUGATERESIDUALSOLVER_H
 
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 #include <vector>
 
 #include <glm/glm.hpp>
@@ -9,210 +12,523 @@
 #include "logging.h"
 
 
-// Vector dot product
-template<typename V>
-inline V operator*(std::vector<V> const &a, std::vector<V> const &b) {
-    LOG_ASSERT(a.size() == b.size());
+namespace conjugate_residual_detail {
 
-    V result = {};
-    for (size_t i = 0, n = a.size(); i < n; i++) {
-        result += a[i] * b[i];
-    }
+inline double dot(double a, double b) {
+    return a * b;
+}
 
-    return result;
+inline double dot(glm::dvec3 const &a, glm::dvec3 const &b) {
+    return glm::dot(a, b);
 }
 
-// Vector of vec3 dot product
-inline double operator*(std::vector<glm::dvec3> const &a, std::vector<glm::dvec3> const &b) {
-    LOG_ASSERT(a.size() == b.size());
+// Diagonal block of an operator on vectors of V
+template<typename V>
+struct Block;
 
-    double result = {};
-    for (size_t i = 0, n = a.size(); i < n; i++) {
-        result += glm::dot(a[i], b[i]);
-    }
+template<>
+struct Block<double> {
+    typedef double type;
+};
+
+template<>
+struct Block<glm::dvec3> {
+    typedef glm::dmat3 type;
+};
 
-    return result;
 }
 
-// Scalar multiply to vector
+/**
+ * Outcome of a conjugate residual solve
+ */
+struct ConjugateResidualResult {
+    enum Termination {
+        CONVERGED, // The residual dropped below the tolerance
+        MAX_ITERATIONS, // The iteration budget ran out first
+        STAGNATED // The increments became insignificant before convergence
+    };
+
+    int iterations = 0;
+    double initialResidual = 0; // ||b - Ax_0||
+    double finalResidual = 0; // ||b - Ax||
+    Termination termination = MAX_ITERATIONS;
+};
+
+/**
+ * Conjugate residual method for symmetric systems, on vectors of double or glm::dvec3
+ *
+ * The operator A is any callable of the form A(std::vector<V> &Ax, std::vector<V> const &x), e.g. a lambda, so it can
+ * be inlined into the solver. Operators may leave entries they don't touch unwritten, those are zero.
+ *
+ * The solver owns its r/p/Ar/Ap workspace, so keeping one instance around (e.g. as a member of the simulation solver)
+ * makes repeated solves of the same size allocation-free. Vector updates are fused: each iteration makes two passes
+ * over the workspace besides the operator applications, and the dot products needed next are accumulated in them.
+ *
+ * The preconditioned variants take either the inverse of the (block) diagonal of A as a Jacobi preconditioner, one
+ * double or glm::dmat3 per entry, which must be symmetric positive definite, or any preconditioner M of the form
+ * M(std::vector<V> &z, std::vector<V> const &r) writing all of z = M^-1 r, which must be linear, symmetric and definite
+ * (e.g. a multigrid V-cycle). A must be self-adjoint in the inner product weighted by weights (per entry, e.g. the node
+ * masses for a system of the form I - M^-1 K), or in the standard one if weights is null. They stop on the same
+ * unpreconditioned residual.
+ *
+ * A solve stops after k iterations, or once ||b - Ax|| < max(absoluteTolerance, relativeTolerance * ||b - Ax_0||).
+ *
+ * Vector updates and dot products run on numThreads threads. Dot products are summed over fixed chunks of entries and
+ * the chunks added in order, so results don't depend on the number of threads.
+ */
 template<typename V>
-inline std::vector<V> operator*(double a, std::vector<V> const &b) {
+class ConjugateResidualSolver {
+public:
 
-    std::vector<V> result(b.size());
-    for (size_t i = 0, n = b.size(); i < n; i++) {
-        result[i] = a * b[i];
+    typedef typename conjugate_residual_detail::Block<V>::type Block;
+
+    static size_t const chunkSize = 1024;
+
+    unsigned int numThreads = 1;
+
+    double relativeTolerance = 0;
+    double absoluteTolerance = std::sqrt(FLT_EPSILON);
+
+    /**
+     * Solves Ax = b
+     * The initial guess is passed in as x
+     * The result will be written in x
+     */
+    template<typename F>
+    ConjugateResidualResult solve(F const &A,
+                                  std::vector<V> &x,
+                                  std::vector<V> const &b,
+                                  int k) {
+        return iterate(x, b, k, A);
     }
 
-    return result;
-}
+    /**
+     * Solves Ax = b, with A a member function of instance
+     */
+    template<typename C>
+    ConjugateResidualResult solve(C *instance,
+                                  void (C::*A)(std::vector<V> &Ax, std::vector<V> const &x),
+                                  std::vector<V> &x,
+                                  std::vector<V> const &b,
+                                  int k) {
+        return iterate(x, b, k, [instance, A](std::vector<V> &Ax, std::vector<V> const &x) {
+            (instance->*A)(Ax, x);
+        });
+    }
 
-// Vector addition
-template<typename V>
-inline std::vector<V> operator+(std::vector<V> const &a, std::vector<V> const &b) {
-    LOG_ASSERT(a.size() == b.size());
+    /**
+     * Solves Ax = b, preconditioned with inverseDiagonal
+     */
+    template<typename F>
+    ConjugateResidualResult solve(F const &A,
+                                  std::vector<Block> const &inverseDiagonal,
+                                  std::vector<V> &x,
+                                  std::vector<V> const &b,
+                                  int k,
+                                  std::vector<double> const *weights = nullptr) {
+        return iteratePreconditioned(x, b, k, inverseDiagonal, weights, A);
+    }
 
-    std::vector<V> result(a.size());
-    for (size_t i = 0, n = a.size(); i < n; i++) {
-        result[i] = a[i] + b[i];
+    /**
+     * Solves Ax = b, preconditioned with M
+     */
+    template<typename F, typename P>
+    ConjugateResidualResult solve(F const &A,
+                                  P const &M,
+                                  std::vector<V> &x,
+                                  std::vector<V> const &b,
+                                  int k,
+                                  std::vector<double> const *weights = nullptr) {
+        return iterateWithPreconditioner(x, b, k, M, weights, A);
     }
 
-    return result;
-}
+    /**
+     * Solves Ax = b, with A a member function of instance, preconditioned with inverseDiagonal
+     */
+    template<typename C>
+    ConjugateResidualResult solve(C *instance,
+                                  void (C::*A)(std::vector<V> &Ax, std::vector<V> const &x),
+                                  std::vector<Block> const &inverseDiagonal,
+                                  std::vector<V> &x,
+                                  std::vector<V> const &b,
+                                  int k,
+                                  std::vector<double> const *weights = nullptr) {
+        return iteratePreconditioned(x, b, k, inverseDiagonal, weights,
+                                     [instance, A](std::vector<V> &Ax, std::vector<V> const &x) {
+                                         (instance->*A)(Ax, x);
+                                     });
+    }
 
-// Vector subtraction
-template<typename V>
-inline std::vector<V> operator-(std::vector<V> const &a, std::vector<V> const &b) {
-    LOG_ASSERT(a.size() == b.size());
+private:
+
+    std::vector<V> r;
+    std::vector<V> p;
+    std::vector<V> Ar;
+    std::vector<V> Ap;
+    std::vector<V> z; // Preconditioned residual
+    std::vector<V> q; // Preconditioned Ap
+
+    std::vector<double> partialSums; // Per chunk
+
+    /**
+     * Runs f(i) for i in [0, n) and returns the sum of the results
+     */
+    template<typename F>
+    double reduce(size_t n, F const &f) {
+        auto numChunks = static_cast<int>((n + chunkSize - 1) / chunkSize);
+        partialSums.resize(numChunks);
+
+#pragma omp parallel for num_threads(numThreads) schedule(static)
+        for (int c = 0; c < numChunks; c++) {
+            double sum = 0;
+            for (size_t i = c * chunkSize, end = std::min(n, (c + 1) * chunkSize); i < end; i++) {
+                sum += f(i);
+            }
+            partialSums[c] = sum;
+        }
+
+        double result = 0;
+        for (auto c = 0; c < numChunks; c++) {
+            result += partialSums[c];
+        }
+
+        return result;
+    }
 
-    std::vector<V> result(a.size());
-    for (size_t i = 0, n = a.size(); i < n; i++) {
-        result[i] = a[i] - b[i];
+    double dot(std::vector<V> const &a, std::vector<V> const &b, std::vector<double> const *weights = nullptr) {
+        return reduce(a.size(), [&](size_t i) {
+            return weight(weights, i) * conjugate_residual_detail::dot(a[i], b[i]);
+        });
     }
 
-    return result;
-}
+    static double weight(std::vector<double> const *weights, size_t i) {
+        return weights ? (*weights)[i] : 1;
+    }
 
-/**
- * Solves Ax = b
- * The initial guess is passed in as x
- * The result will be written in x
- */
-template<typename V>
-inline void conjugateResidualSolver(void (*A)(std::vector<V> &Ax, std::vector<V> const &x),
-                                    std::vector<V> &x,
-                                    std::vector<V> const &b,
-                                    int k) {
-    std::vector<V> Ax(b.size());
+    // Squared residual norm to stop below, given the initial one
+    double squaredTolerance(double dot_r_r_0) const {
+        return std::max(absoluteTolerance * absoluteTolerance, relativeTolerance * relativeTolerance * dot_r_r_0);
+    }
+
+    static ConjugateResidualResult finish(ConjugateResidualResult result, double dot_r_r, double tolerance,
+                                          bool stagnated) {
+        result.finalResidual = std::sqrt(dot_r_r);
+
+        if (dot_r_r < tolerance) {
+            result.termination = ConjugateResidualResult::CONVERGED;
+            LOG(VERBOSE) << "Converged after " << result.iterations << " iterations" << std::endl;
+        } else if (stagnated) {
+            result.termination = ConjugateResidualResult::STAGNATED;
+            LOG(VERBOSE) << "Stagnated after " << result.iterations << " iterations" << std::endl;
+        } else {
+            result.termination = ConjugateResidualResult::MAX_ITERATIONS;
+            LOG(VERBOSE) << "Didn't converge" << std::endl;
+        }
+
+        return result;
+    }
 
-    // Ax_0
-    A(Ax, x);
+    template<typename F>
+    ConjugateResidualResult iterate(std::vector<V> &x, std::vector<V> const &b, int k, F const &A) {
+        LOG_ASSERT(x.size() == b.size());
 
-    // r_0
-    auto r = b - Ax;
+        auto n = b.size();
 
-    // p_0
-    auto p = r;
+        // NB: Operators may leave entries they skip untouched, those must stay zero
+        r.resize(n);
+        p.resize(n);
+        Ar.assign(n, V());
+        Ap.resize(n);
 
-    std::vector<V> Ar(b.size());
-    A(Ar, r);
-    auto dot_r_Ar = r * Ar;
+        // Ax_0
+        A(Ar, x);
 
-    std::vector<V> Ap(b.size());
-    A(Ap, p);
+        // r_0, p_0
+        auto dot_r_r = reduce(n, [&](size_t i) {
+            r[i] = b[i] - Ar[i];
+            p[i] = r[i];
+            return conjugate_residual_detail::dot(r[i], r[i]);
+        });
 
-    while (k-- > 0 && r * r >= FLT_EPSILON) {
-        LOG(VERBOSE) << "Solving k=" << k << std::endl;
+        ConjugateResidualResult result;
+        result.initialResidual = std::sqrt(dot_r_r);
+        auto tolerance = squaredTolerance(dot_r_r);
+        auto stagnated = false;
 
-        // r_k^T Ar_k
-        auto dot_r_Ar_k = dot_r_Ar;
+        A(Ar, r);
+        auto dot_r_Ar = dot(r, Ar);
 
-        // a_k
-        auto a = dot_r_Ar_k / (Ap * Ap);
+        // Ap_0 = Ar_0 since p_0 = r_0
+        Ap = Ar;
 
-        if (abs(a) < FLT_EPSILON) break; // Non-standard: Break if insignificant increment
+        auto dot_Ap_Ap = dot(Ap, Ap);
 
-        // x_k+1
-        x = x + a * p;
+        while (result.iterations < k && dot_r_r >= tolerance) {
 
-        // r_k+1
-        r = r - a * Ap;
+            // r_k^T Ar_k
+            auto dot_r_Ar_k = dot_r_Ar;
 
-        // Ar_k+1
-        A(Ar, r);
+            // a_k
+            auto a = dot_r_Ar_k / dot_Ap_Ap;
+
+            if (std::abs(a) < FLT_EPSILON) {
+                stagnated = true; // Non-standard: Break if insignificant increment
+                break;
+            }
+
+            // x_k+1, r_k+1
+            dot_r_r = reduce(n, [&](size_t i) {
+                x[i] += a * p[i];
+                r[i] -= a * Ap[i];
+                return conjugate_residual_detail::dot(r[i], r[i]);
+            });
 
-        dot_r_Ar = r * Ar;
+            result.iterations++;
 
-        // b_k
-        auto beta = dot_r_Ar / dot_r_Ar_k;
+            // Ar_k+1
+            A(Ar, r);
 
-        if (abs(beta) < FLT_EPSILON) break; // Non-standard: Break if insignificant increment
+            dot_r_Ar = dot(r, Ar);
 
-        // p_k+1
-        p = r + beta * p;
+            // b_k
+            auto beta = dot_r_Ar / dot_r_Ar_k;
 
-        // Ap_k+1
-        Ap = Ar + beta * Ap;
+            if (std::abs(beta) < FLT_EPSILON) {
+                stagnated = true; // Non-standard: Break if insignificant increment
+                break;
+            }
 
+            // p_k+1, Ap_k+1
+            dot_Ap_Ap = reduce(n, [&](size_t i) {
+                p[i] = r[i] + beta * p[i];
+                Ap[i] = Ar[i] + beta * Ap[i];
+                return conjugate_residual_detail::dot(Ap[i], Ap[i]);
+            });
+
+        }
+
+        return finish(result, dot_r_r, tolerance, stagnated);
     }
 
-    if (k > 0) {
-        LOG(VERBOSE) << "Converged at k=" << k << std::endl;
-    } else {
-        LOG(VERBOSE) << "Didn't converge" << std::endl;
+    template<typename F>
+    ConjugateResidualResult iteratePreconditioned(std::vector<V> &x, std::vector<V> const &b, int k,
+                                                  std::vector<Block> const &inverseDiagonal,
+                                                  std::vector<double> const *weights, F const &A) {
+        LOG_ASSERT(x.size() == b.size() && inverseDiagonal.size() == b.size());
+        LOG_ASSERT(!weights || weights->size() == b.size());
+
+        auto n = b.size();
+
+        // NB: Operators may leave entries they skip untouched, those must stay zero
+        r.resize(n);
+        z.resize(n);
+        p.resize(n);
+        Ar.assign(n, V());
+        Ap.resize(n);
+        q.resize(n);
+
+        // Ax_0
+        A(Ar, x);
+
+        // r_0, z_0, p_0
+        auto dot_r_r = reduce(n, [&](size_t i) {
+            r[i] = b[i] - Ar[i];
+            z[i] = inverseDiagonal[i] * r[i];
+            p[i] = z[i];
+            return conjugate_residual_detail::dot(r[i], r[i]);
+        });
+
+        ConjugateResidualResult result;
+        result.initialResidual = std::sqrt(dot_r_r);
+        auto tolerance = squaredTolerance(dot_r_r);
+        auto stagnated = false;
+
+        // Az_0
+        A(Ar, z);
+        auto dot_z_Az = dot(z, Ar, weights);
+
+        // Ap_0 = Az_0 since p_0 = z_0
+        auto dot_Ap_q = reduce(n, [&](size_t i) {
+            Ap[i] = Ar[i];
+            q[i] = inverseDiagonal[i] * Ap[i];
+            return weight(weights, i) * conjugate_residual_detail::dot(Ap[i], q[i]);
+        });
+
+        while (result.iterations < k && dot_r_r >= tolerance) {
+
+            // z_k^T Az_k
+            auto dot_z_Az_k = dot_z_Az;
+
+            // a_k
+            auto a = dot_z_Az_k / dot_Ap_q;
+
+            if (std::abs(a) < FLT_EPSILON) {
+                stagnated = true; // Non-standard: Break if insignificant increment
+                break;
+            }
+
+            // x_k+1, r_k+1, z_k+1
+            dot_r_r = reduce(n, [&](size_t i) {
+                x[i] += a * p[i];
+                r[i] -= a * Ap[i];
+                z[i] -= a * q[i];
+                return conjugate_residual_detail::dot(r[i], r[i]);
+            });
+
+            result.iterations++;
+
+            // Az_k+1
+            A(Ar, z);
+
+            dot_z_Az = dot(z, Ar, weights);
+
+            // b_k
+            auto beta = dot_z_Az / dot_z_Az_k;
+
+            if (std::abs(beta) < FLT_EPSILON) {
+                stagnated = true; // Non-standard: Break if insignificant increment
+                break;
+            }
+
+            // p_k+1, Ap_k+1, q_k+1
+            dot_Ap_q = reduce(n, [&](size_t i) {
+                p[i] = z[i] + beta * p[i];
+                Ap[i] = Ar[i] + beta * Ap[i];
+                q[i] = inverseDiagonal[i] * Ap[i];
+                return weight(weights, i) * conjugate_residual_detail::dot(Ap[i], q[i]);
+            });
+
+        }
+
+        return finish(result, dot_r_r, tolerance, stagnated);
     }
 
-}
+    template<typename P, typename F>
+    ConjugateResidualResult iterateWithPreconditioner(std::vector<V> &x, std::vector<V> const &b, int k, P const &M,
+                                                      std::vector<double> const *weights, F const &A) {
+        LOG_ASSERT(x.size() == b.size());
+        LOG_ASSERT(!weights || weights->size() == b.size());
 
-/**
- * Solves Ax = b
- * The initial guess is passed in as x
- * The result will be written in x
- */
-template<typename C, typename V>
-inline void conjugateResidualSolver(C *instance,
-                                    void (C::*A)(std::vector<V> &Ax, std::vector<V> const &x),
-                                    std::vector<V> &x,
-                                    std::vector<V> const &b,
-                                    int k) {
-    std::vector<V> Ax(b.size());
+        auto n = b.size();
 
-    // Ax_0
-    (instance->*A)(Ax, x);
+        // NB: Operators may leave entries they skip untouched, those must stay zero
+        r.resize(n);
+        z.resize(n);
+        p.resize(n);
+        Ar.assign(n, V());
+        Ap.resize(n);
+        q.resize(n);
 
-    // r_0
-    auto r = b - Ax;
+        // Ax_0
+        A(Ar, x);
 
-    // p_0
-    auto p = r;
+        // r_0
+        auto dot_r_r = reduce(n, [&](size_t i) {
+            r[i] = b[i] - Ar[i];
+            return conjugate_residual_detail::dot(r[i], r[i]);
+        });
 
-    std::vector<V> Ar(b.size());
-    (instance->*A)(Ar, r);
-    auto dot_r_Ar = r * Ar;
+        ConjugateResidualResult result;
+        result.initialResidual = std::sqrt(dot_r_r);
+        auto tolerance = squaredTolerance(dot_r_r);
+        auto stagnated = false;
 
-    std::vector<V> Ap(b.size());
-    (instance->*A)(Ap, p);
+        // z_0, p_0
+        M(z, r);
+        p = z;
 
-    while (k-- > 0 && r * r >= FLT_EPSILON) {
-        LOG(VERBOSE) << "Solving k=" << k << std::endl;
+        // Az_0
+        A(Ar, z);
+        auto dot_z_Az = dot(z, Ar, weights);
 
-        // r_k^T Ar_k
-        auto dot_r_Ar_k = dot_r_Ar;
+        // Ap_0 = Az_0 since p_0 = z_0
+        Ap = Ar;
+        M(q, Ap);
+        auto dot_Ap_q = dot(Ap, q, weights);
 
-        // a_k
-        auto a = dot_r_Ar_k / (Ap * Ap);
+        while (result.iterations < k && dot_r_r >= tolerance) {
 
-        if (abs(a) < FLT_EPSILON) break; // Non-standard: Break if insignificant increment
+            // z_k^T Az_k
+            auto dot_z_Az_k = dot_z_Az;
 
-        // x_k+1
-        x = x + a * p;
+            // a_k
+            auto a = dot_z_Az_k / dot_Ap_q;
 
-        // r_k+1
-        r = r - a * Ap;
+            if (std::abs(a) < FLT_EPSILON) {
+                stagnated = true; // Non-standard: Break if insignificant increment
+                break;
+            }
 
-        // Ar_k+1
-        (instance->*A)(Ar, r);
+            // x_k+1, r_k+1, z_k+1
+            dot_r_r = reduce(n, [&](size_t i) {
+                x[i] += a * p[i];
+                r[i] -= a * Ap[i];
+                z[i] -= a * q[i];
+                return conjugate_residual_detail::dot(r[i], r[i]);
+            });
 
-        dot_r_Ar = r * Ar;
+            result.iterations++;
 
-        // b_k
-        auto beta = dot_r_Ar / dot_r_Ar_k;
+            // Az_k+1
+            A(Ar, z);
 
-        if (abs(beta) < FLT_EPSILON) break; // Non-standard: Break if insignificant increment
+            dot_z_Az = dot(z, Ar, weights);
 
-        // p_k+1
-        p = r + beta * p;
+            // b_k
+            auto beta = dot_z_Az / dot_z_Az_k;
 
-        // Ap_k+1
-        Ap = Ar + beta * Ap;
+            if (std::abs(beta) < FLT_EPSILON) {
+                stagnated = true; // Non-standard: Break if insignificant increment
+                break;
+            }
 
-    }
+            // p_k+1, Ap_k+1
+#pragma omp parallel for num_threads(numThreads) schedule(static)
+            for (int i = 0; i < static_cast<int>(n); i++) {
+                p[i] = z[i] + beta * p[i];
+                Ap[i] = Ar[i] + beta * Ap[i];
+            }
+
+            // q_k+1
+            M(q, Ap);
+            dot_Ap_q = dot(Ap, q, weights);
 
-    if (k > 0) {
-        LOG(VERBOSE) << "Converged at k=" << k << std::endl;
-    } else {
-        LOG(VERBOSE) << "Didn't converge" << std::endl;
+        }
+
+        return finish(result, dot_r_r, tolerance, stagnated);
     }
 
+};
+
+/**
+ * Solves Ax = b
+ * The initial guess is passed in as x
+ * The result will be written in x
+ *
+ * NB: Allocates a workspace on every call, keep a ConjugateResidualSolver around for repeated solves
+ */
+template<typename V>
+inline void conjugateResidualSolver(void (*A)(std::vector<V> &Ax, std::vector<V> const &x),
+                                    std::vector<V> &x,
+                                    std::vector<V> const &b,
+                                    int k) {
+    ConjugateResidualSolver<V>().solve(A, x, b, k);
+}
+
+/**
+ * Solves Ax = b
+ * The initial guess is passed in as x
+ * The result will be written in x
+ *
+ * NB: Allocates a workspace on every call, keep a ConjugateResidualSolver around for repeated solves
+ */
+template<typename C, typename V>
+inline void conjugateResidualSolver(C *instance,
+                                    void (C::*A)(std::vector<V> &Ax, std::vector<V> const &x),
+                                    std::vector<V> &x,
+                                    std::vector<V> const &b,
+                                    int k) {
+    ConjugateResidualSolver<V>().solve(instance, A, x, b, k);
 }
 
 
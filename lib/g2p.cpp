@@ -0,0 +1,255 @@
+#include "g2p.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SNOW_G2P_X86
+#include <immintrin.h>
+#endif
+
+
+// The kernels return their sums as nabla_v[i][j] = sum velocity_star_i * nabla_weight_j (without the 1 / h factor),
+// v_pic and delta_v, which are stored as a G2PTransfer by g2p() once the vector kernels have returned (and cleared the
+// upper register state, mixing in non-VEX code before that stalls on some CPUs)
+
+static void g2pScalar(StencilWeights<CubicBSpline> const &weights, G2PStencil const &stencil, double nabla_v[3][3],
+                      double v_pic[3], double delta_v[3]) {
+    for (int k = 0; k < 3; k++) {
+        for (int l = 0; l < 3; l++) {
+            nabla_v[k][l] = 0;
+        }
+        v_pic[k] = delta_v[k] = 0;
+    }
+
+    for (int a = 0; a < 4; a++) {
+        for (int b = 0; b < 4; b++) {
+            auto nab = weights.n[0][a] * weights.n[1][b];
+            auto dnab_x = weights.del_n[0][a] * weights.n[1][b];
+            auto dnab_y = weights.n[0][a] * weights.del_n[1][b];
+
+            for (int c = 0; c < 4; c++) {
+                auto i = a * 16 + b * 4 + c;
+
+                auto w = nab * weights.n[2][c];
+                double nabla_w[3] = {dnab_x * weights.n[2][c], dnab_y * weights.n[2][c], nab * weights.del_n[2][c]};
+
+                for (int k = 0; k < 3; k++) {
+                    auto gv1 = stencil.velocity_star[k][i];
+                    v_pic[k] += gv1 * w;
+                    delta_v[k] += (gv1 - stencil.velocity[k][i]) * w;
+                    for (int l = 0; l < 3; l++) {
+                        nabla_v[k][l] += gv1 * nabla_w[l];
+                    }
+                }
+            }
+        }
+    }
+}
+
+#ifdef SNOW_G2P_X86
+
+// The accumulators are spelled out (rather than kept in arrays) so that they stay in registers at any optimization level
+
+__attribute__((target("avx2,fma")))
+static double hsum(__m256d x) {
+    auto lo = _mm256_castpd256_pd128(x);
+    auto hi = _mm256_extractf128_pd(x, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx2,fma")))
+static void g2pAvx2(StencilWeights<CubicBSpline> const &weights, G2PStencil const &stencil, double nabla_v[3][3],
+                    double v_pic[3], double delta_v[3]) {
+    auto nabla_v_xx = _mm256_setzero_pd(), nabla_v_xy = _mm256_setzero_pd(), nabla_v_xz = _mm256_setzero_pd();
+    auto nabla_v_yx = _mm256_setzero_pd(), nabla_v_yy = _mm256_setzero_pd(), nabla_v_yz = _mm256_setzero_pd();
+    auto nabla_v_zx = _mm256_setzero_pd(), nabla_v_zy = _mm256_setzero_pd(), nabla_v_zz = _mm256_setzero_pd();
+    auto v_pic_x = _mm256_setzero_pd(), v_pic_y = _mm256_setzero_pd(), v_pic_z = _mm256_setzero_pd();
+    auto delta_v_x = _mm256_setzero_pd(), delta_v_y = _mm256_setzero_pd(), delta_v_z = _mm256_setzero_pd();
+
+    auto nz = _mm256_loadu_pd(weights.n[2]);
+    auto dnz = _mm256_loadu_pd(weights.del_n[2]);
+
+    for (int a = 0; a < 4; a++) {
+        for (int b = 0; b < 4; b++) {
+            auto i = a * 16 + b * 4;
+
+            // One z column of the stencil
+            auto nab = _mm256_set1_pd(weights.n[0][a] * weights.n[1][b]);
+            auto w = _mm256_mul_pd(nab, nz);
+            auto nabla_w_x = _mm256_mul_pd(_mm256_set1_pd(weights.del_n[0][a] * weights.n[1][b]), nz);
+            auto nabla_w_y = _mm256_mul_pd(_mm256_set1_pd(weights.n[0][a] * weights.del_n[1][b]), nz);
+            auto nabla_w_z = _mm256_mul_pd(nab, dnz);
+
+            auto gv1_x = _mm256_load_pd(stencil.velocity_star[0] + i);
+            auto gv1_y = _mm256_load_pd(stencil.velocity_star[1] + i);
+            auto gv1_z = _mm256_load_pd(stencil.velocity_star[2] + i);
+
+            v_pic_x = _mm256_fmadd_pd(gv1_x, w, v_pic_x);
+            v_pic_y = _mm256_fmadd_pd(gv1_y, w, v_pic_y);
+            v_pic_z = _mm256_fmadd_pd(gv1_z, w, v_pic_z);
+
+            delta_v_x = _mm256_fmadd_pd(_mm256_sub_pd(gv1_x, _mm256_load_pd(stencil.velocity[0] + i)), w, delta_v_x);
+            delta_v_y = _mm256_fmadd_pd(_mm256_sub_pd(gv1_y, _mm256_load_pd(stencil.velocity[1] + i)), w, delta_v_y);
+            delta_v_z = _mm256_fmadd_pd(_mm256_sub_pd(gv1_z, _mm256_load_pd(stencil.velocity[2] + i)), w, delta_v_z);
+
+            nabla_v_xx = _mm256_fmadd_pd(gv1_x, nabla_w_x, nabla_v_xx);
+            nabla_v_xy = _mm256_fmadd_pd(gv1_x, nabla_w_y, nabla_v_xy);
+            nabla_v_xz = _mm256_fmadd_pd(gv1_x, nabla_w_z, nabla_v_xz);
+            nabla_v_yx = _mm256_fmadd_pd(gv1_y, nabla_w_x, nabla_v_yx);
+            nabla_v_yy = _mm256_fmadd_pd(gv1_y, nabla_w_y, nabla_v_yy);
+            nabla_v_yz = _mm256_fmadd_pd(gv1_y, nabla_w_z, nabla_v_yz);
+            nabla_v_zx = _mm256_fmadd_pd(gv1_z, nabla_w_x, nabla_v_zx);
+            nabla_v_zy = _mm256_fmadd_pd(gv1_z, nabla_w_y, nabla_v_zy);
+            nabla_v_zz = _mm256_fmadd_pd(gv1_z, nabla_w_z, nabla_v_zz);
+        }
+    }
+
+    nabla_v[0][0] = hsum(nabla_v_xx), nabla_v[0][1] = hsum(nabla_v_xy), nabla_v[0][2] = hsum(nabla_v_xz);
+    nabla_v[1][0] = hsum(nabla_v_yx), nabla_v[1][1] = hsum(nabla_v_yy), nabla_v[1][2] = hsum(nabla_v_yz);
+    nabla_v[2][0] = hsum(nabla_v_zx), nabla_v[2][1] = hsum(nabla_v_zy), nabla_v[2][2] = hsum(nabla_v_zz);
+    v_pic[0] = hsum(v_pic_x), v_pic[1] = hsum(v_pic_y), v_pic[2] = hsum(v_pic_z);
+    delta_v[0] = hsum(delta_v_x), delta_v[1] = hsum(delta_v_y), delta_v[2] = hsum(delta_v_z);
+}
+
+// NB: The 256-bit lane moves below use the masked intrinsics with all lanes selected and a defined pass-through, the
+// unmasked ones pass an undefined vector to their builtins, which trips -Wuninitialized with some GCC versions
+
+// Broadcasts lo to the lower and hi to the upper 4 lanes
+__attribute__((target("avx512f")))
+static __m512d pair(double lo, double hi) {
+    auto x = _mm512_set1_pd(lo);
+    return _mm512_mask_insertf64x4(x, 0xff, x, _mm256_set1_pd(hi), 1);
+}
+
+// Broadcasts x to the lower and upper 4 lanes
+__attribute__((target("avx512f")))
+static __m512d broadcast(__m256d x) {
+    return _mm512_mask_broadcast_f64x4(_mm512_setzero_pd(), 0xff, x);
+}
+
+__attribute__((target("avx512f")))
+static double hsum(__m512d x) {
+    auto x4 = _mm256_add_pd(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xf, x, 0),
+                            _mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xf, x, 1));
+    auto lo = _mm256_castpd256_pd128(x4);
+    auto hi = _mm256_extractf128_pd(x4, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+__attribute__((target("avx512f")))
+static void g2pAvx512(StencilWeights<CubicBSpline> const &weights, G2PStencil const &stencil, double nabla_v[3][3],
+                      double v_pic[3], double delta_v[3]) {
+    auto nabla_v_xx = _mm512_setzero_pd(), nabla_v_xy = _mm512_setzero_pd(), nabla_v_xz = _mm512_setzero_pd();
+    auto nabla_v_yx = _mm512_setzero_pd(), nabla_v_yy = _mm512_setzero_pd(), nabla_v_yz = _mm512_setzero_pd();
+    auto nabla_v_zx = _mm512_setzero_pd(), nabla_v_zy = _mm512_setzero_pd(), nabla_v_zz = _mm512_setzero_pd();
+    auto v_pic_x = _mm512_setzero_pd(), v_pic_y = _mm512_setzero_pd(), v_pic_z = _mm512_setzero_pd();
+    auto delta_v_x = _mm512_setzero_pd(), delta_v_y = _mm512_setzero_pd(), delta_v_z = _mm512_setzero_pd();
+
+    auto nz = broadcast(_mm256_loadu_pd(weights.n[2]));
+    auto dnz = broadcast(_mm256_loadu_pd(weights.del_n[2]));
+
+    for (int a = 0; a < 4; a++) {
+        for (int b = 0; b < 4; b += 2) {
+            auto i = a * 16 + b * 4;
+
+            // Two z columns (b, b + 1) of the stencil
+            auto nab = pair(weights.n[0][a] * weights.n[1][b], weights.n[0][a] * weights.n[1][b + 1]);
+            auto w = _mm512_mul_pd(nab, nz);
+            auto nabla_w_x = _mm512_mul_pd(pair(weights.del_n[0][a] * weights.n[1][b],
+                                                weights.del_n[0][a] * weights.n[1][b + 1]), nz);
+            auto nabla_w_y = _mm512_mul_pd(pair(weights.n[0][a] * weights.del_n[1][b],
+                                                weights.n[0][a] * weights.del_n[1][b + 1]), nz);
+            auto nabla_w_z = _mm512_mul_pd(nab, dnz);
+
+            auto gv1_x = _mm512_load_pd(stencil.velocity_star[0] + i);
+            auto gv1_y = _mm512_load_pd(stencil.velocity_star[1] + i);
+            auto gv1_z = _mm512_load_pd(stencil.velocity_star[2] + i);
+
+            v_pic_x = _mm512_fmadd_pd(gv1_x, w, v_pic_x);
+            v_pic_y = _mm512_fmadd_pd(gv1_y, w, v_pic_y);
+            v_pic_z = _mm512_fmadd_pd(gv1_z, w, v_pic_z);
+
+            delta_v_x = _mm512_fmadd_pd(_mm512_sub_pd(gv1_x, _mm512_load_pd(stencil.velocity[0] + i)), w, delta_v_x);
+            delta_v_y = _mm512_fmadd_pd(_mm512_sub_pd(gv1_y, _mm512_load_pd(stencil.velocity[1] + i)), w, delta_v_y);
+            delta_v_z = _mm512_fmadd_pd(_mm512_sub_pd(gv1_z, _mm512_load_pd(stencil.velocity[2] + i)), w, delta_v_z);
+
+            nabla_v_xx = _mm512_fmadd_pd(gv1_x, nabla_w_x, nabla_v_xx);
+            nabla_v_xy = _mm512_fmadd_pd(gv1_x, nabla_w_y, nabla_v_xy);
+            nabla_v_xz = _mm512_fmadd_pd(gv1_x, nabla_w_z, nabla_v_xz);
+            nabla_v_yx = _mm512_fmadd_pd(gv1_y, nabla_w_x, nabla_v_yx);
+            nabla_v_yy = _mm512_fmadd_pd(gv1_y, nabla_w_y, nabla_v_yy);
+            nabla_v_yz = _mm512_fmadd_pd(gv1_y, nabla_w_z, nabla_v_yz);
+            nabla_v_zx = _mm512_fmadd_pd(gv1_z, nabla_w_x, nabla_v_zx);
+            nabla_v_zy = _mm512_fmadd_pd(gv1_z, nabla_w_y, nabla_v_zy);
+            nabla_v_zz = _mm512_fmadd_pd(gv1_z, nabla_w_z, nabla_v_zz);
+        }
+    }
+
+    nabla_v[0][0] = hsum(nabla_v_xx);
+    nabla_v[0][1] = hsum(nabla_v_xy);
+    nabla_v[0][2] = hsum(nabla_v_xz);
+    nabla_v[1][0] = hsum(nabla_v_yx);
+    nabla_v[1][1] = hsum(nabla_v_yy);
+    nabla_v[1][2] = hsum(nabla_v_yz);
+    nabla_v[2][0] = hsum(nabla_v_zx);
+    nabla_v[2][1] = hsum(nabla_v_zy);
+    nabla_v[2][2] = hsum(nabla_v_zz);
+    v_pic[0] = hsum(v_pic_x);
+    v_pic[1] = hsum(v_pic_y);
+    v_pic[2] = hsum(v_pic_z);
+    delta_v[0] = hsum(delta_v_x);
+    delta_v[1] = hsum(delta_v_y);
+    delta_v[2] = hsum(delta_v_z);
+}
+
+#endif //SNOW_G2P_X86
+
+bool isG2PKernelSupported(G2PKernel kernel) {
+    switch (kernel) {
+        case G2P_SCALAR:
+            return true;
+#ifdef SNOW_G2P_X86
+        case G2P_AVX2:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case G2P_AVX512:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+G2PKernel getG2PKernel() {
+    if (isG2PKernelSupported(G2P_AVX512)) return G2P_AVX512;
+    if (isG2PKernelSupported(G2P_AVX2)) return G2P_AVX2;
+    return G2P_SCALAR;
+}
+
+void g2p(G2PKernel kernel, StencilWeights<CubicBSpline> const &weights, G2PStencil const &stencil,
+         G2PTransfer &transfer) {
+    double nabla_v[3][3];
+    double v_pic[3];
+    double delta_v[3];
+
+    switch (kernel) {
+#ifdef SNOW_G2P_X86
+        case G2P_AVX2:
+            g2pAvx2(weights, stencil, nabla_v, v_pic, delta_v);
+            break;
+        case G2P_AVX512:
+            g2pAvx512(weights, stencil, nabla_v, v_pic, delta_v);
+            break;
+#endif
+        default:
+            g2pScalar(weights, stencil, nabla_v, v_pic, delta_v);
+            break;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            transfer.nabla_v[j][i] = weights.invh * nabla_v[i][j]; // Column j of the outer product
+        }
+    }
+    transfer.v_pic = glm::dvec3(v_pic[0], v_pic[1], v_pic[2]);
+    transfer.delta_v = glm::dvec3(delta_v[0], delta_v[1], delta_v[2]);
+}
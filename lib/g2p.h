@@ -0,0 +1,47 @@
+#ifndef SNOW_G2P_H
+#define SNOW_G2P_H
+
+
+#include <glm/glm.hpp>
+
+#include "StencilWeights.h"
+
+
+/**
+ * Grid-to-particle transfer kernels (steps 7 and 8 of the snow solver)
+ *
+ * The grid values around a particle are gathered into a G2PStencil, then one of the kernels below accumulates the
+ * velocity gradient and the PIC/FLIP velocities over the 64 stencil nodes. Besides the portable scalar kernel there are
+ * AVX2 (one z column of 4 nodes per register) and AVX-512 (two z columns per register) kernels on x86, compiled with
+ * target attributes so that getG2PKernel() can pick the best one supported by the CPU at runtime.
+ */
+
+enum G2PKernel {
+    G2P_SCALAR,
+    G2P_AVX2,
+    G2P_AVX512
+};
+
+// Grid values gathered over a 4x4x4 stencil, one array per component, stencil node i is gmin + (i / 16, (i / 4) % 4,
+// i % 4) like for StencilWeights. Nodes outside the grid are zero
+struct G2PStencil {
+    alignas(64) double velocity[3][64];
+    alignas(64) double velocity_star[3][64];
+};
+
+struct G2PTransfer {
+    glm::dmat3 nabla_v; // sum velocity_star (x) nabla_weight
+    glm::dvec3 v_pic; // sum velocity_star * weight
+    glm::dvec3 delta_v; // sum (velocity_star - velocity) * weight, the FLIP velocity increment
+};
+
+bool isG2PKernelSupported(G2PKernel kernel);
+
+// Best kernel supported by the CPU
+G2PKernel getG2PKernel();
+
+void g2p(G2PKernel kernel, StencilWeights<CubicBSpline> const &weights, G2PStencil const &stencil,
+         G2PTransfer &transfer);
+
+
+#endif //SNOW_G2P_H
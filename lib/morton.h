@@ -0,0 +1,65 @@
+#ifndef SNOW_MORTON_H
+#define SNOW_MORTON_H
+
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+
+// Spreads the lower 21 bits of x so that there are two zero bits between each
+inline uint64_t mortonSpread(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+// Z-order (Morton) key of a grid cell
+inline uint64_t mortonKey(glm::uvec3 const &cell) {
+    return mortonSpread(cell.x) << 2 | mortonSpread(cell.y) << 1 | mortonSpread(cell.z);
+}
+
+/**
+ * Returns the particle indices sorted by the Morton key of the grid cell containing each particle
+ * Particles in the same cell keep their relative order
+ */
+template<typename F>
+inline std::vector<unsigned int> mortonOrder(unsigned int numParticles, double h, F position) {
+    std::vector<std::pair<uint64_t, unsigned int>> keys(numParticles);
+    for (unsigned int p = 0; p < numParticles; p++) {
+        auto cell = position(p) / h;
+        keys[p].first = mortonKey(glm::uvec3(cell.x > 0 ? cell.x : 0,
+                                             cell.y > 0 ? cell.y : 0,
+                                             cell.z > 0 ? cell.z : 0));
+        keys[p].second = p;
+    }
+
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<unsigned int> order(numParticles);
+    for (unsigned int p = 0; p < numParticles; p++) {
+        order[p] = keys[p].second;
+    }
+    return order;
+}
+
+// Reorders v such that v'[i] = v[order[i]]
+template<typename T>
+inline void applyOrder(std::vector<T> &v, std::vector<unsigned int> const &order) {
+    std::vector<T> ordered;
+    ordered.reserve(v.size());
+    for (auto i : order) {
+        ordered.push_back(v[i]);
+    }
+    v.swap(ordered);
+}
+
+
+#endif //SNOW_MORTON_H
@@ -0,0 +1,191 @@
+#ifndef SNOW_SVD3_H
+#define SNOW_SVD3_H
+
+
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+
+/**
+ * Fixed-iteration 3x3 singular value decomposition, m = u * diag(e) * transpose(v)
+ *
+ * Follows McAdams et al. "Computing the Singular Value Decomposition of 3x3 matrices with minimal branching and
+ * elementary floating point operations": a fixed number of cyclic Jacobi sweeps diagonalize transpose(m) * m, with the
+ * rotations accumulated in a quaternion for v, the columns of m * v are sorted by decreasing norm and a Givens QR
+ * factorization of them gives u and e. Jacobi rotations are exact (no approximate Givens angles) since we work in
+ * double precision. There is no data-dependent control flow, the few selects compile to conditional moves.
+ *
+ * u and v are always rotations and e is sorted by decreasing magnitude, so e.z is negative if m is a reflection.
+ */
+
+namespace svd3_detail {
+
+unsigned int const numSweeps = 4;
+
+// Jacobi rotation in the (p, r) plane zeroing s_pr, applied to the symmetric matrix s and accumulated in quaternion q
+// (w, x, y, z), with k the remaining axis such that (p, r, k) is a cyclic permutation of (0, 1, 2)
+inline void jacobiConjugate(double s[3][3], double q[4], int p, int r, int k) {
+    auto a = s[p][p] - s[r][r];
+    auto b = 2 * s[p][r];
+
+    // Rotation angle phi with tan(2 phi) = b / a and |phi| <= pi / 4
+    // Identity rotation if the pair is already decoupled with equal diagonal entries (a == b == 0)
+    auto len = std::sqrt(a * a + b * b);
+    auto rotate = len > 1e-300;
+    auto cos2 = rotate ? std::abs(a) / len : 1;
+    auto sin2 = rotate ? std::copysign(1.0, a) * b / len : 0;
+
+    auto c = std::sqrt(0.5 * (1 + cos2));
+    auto sn = sin2 / (2 * c);
+
+    // s' = transpose(R) * s * R
+    auto spp = s[p][p], srr = s[r][r], spr = s[p][r], spk = s[p][k], srk = s[r][k];
+    s[p][p] = c * c * spp + 2 * c * sn * spr + sn * sn * srr;
+    s[r][r] = sn * sn * spp - 2 * c * sn * spr + c * c * srr;
+    s[p][r] = s[r][p] = 0;
+    s[p][k] = s[k][p] = c * spk + sn * srk;
+    s[r][k] = s[k][r] = -sn * spk + c * srk;
+
+    // q' = q * (cos(phi / 2), sin(phi / 2) e_k)
+    auto ch = std::sqrt(0.5 * (1 + c));
+    auto sh = sn / (2 * ch);
+
+    double qk[4] = {0, 0, 0, 0};
+    qk[0] = ch;
+    qk[1 + k] = sh;
+
+    double w = q[0], x = q[1], y = q[2], z = q[3];
+    q[0] = w * qk[0] - x * qk[1] - y * qk[2] - z * qk[3];
+    q[1] = w * qk[1] + x * qk[0] + y * qk[3] - z * qk[2];
+    q[2] = w * qk[2] - x * qk[3] + y * qk[0] + z * qk[1];
+    q[3] = w * qk[3] + x * qk[2] - y * qk[1] + z * qk[0];
+}
+
+// Swaps columns i and j of b and v if column i is shorter, negating one of them to keep v a rotation
+inline void sortColumns(glm::dmat3 &b, glm::dmat3 &v, double rho[3], int i, int j) {
+    auto swap = rho[i] < rho[j];
+
+    for (int r = 0; r < 3; r++) {
+        auto bi = b[i][r], bj = b[j][r], vi = v[i][r], vj = v[j][r];
+        b[i][r] = swap ? bj : bi;
+        b[j][r] = swap ? -bi : bj;
+        v[i][r] = swap ? vj : vi;
+        v[j][r] = swap ? -vi : vj;
+    }
+
+    auto rhoi = rho[i];
+    rho[i] = swap ? rho[j] : rho[i];
+    rho[j] = swap ? rhoi : rho[j];
+}
+
+// Givens rotation on rows (i, j) of b zeroing b_ji, accumulated in u
+inline void qrGivens(glm::dmat3 &b, glm::dmat3 &u, int i, int j) {
+    auto x = b[i][i], y = b[i][j];
+
+    auto len = std::sqrt(x * x + y * y);
+    auto degenerate = len < 1e-300;
+    auto c = degenerate ? 1 : x / len;
+    auto s = degenerate ? 0 : y / len;
+
+    for (int col = 0; col < 3; col++) {
+        auto bi = b[col][i], bj = b[col][j];
+        b[col][i] = c * bi + s * bj;
+        b[col][j] = -s * bi + c * bj;
+    }
+
+    for (int row = 0; row < 3; row++) {
+        auto ui = u[i][row], uj = u[j][row];
+        u[i][row] = c * ui + s * uj;
+        u[j][row] = -s * ui + c * uj;
+    }
+}
+
+// Decomposes N matrices in lockstep, interleaving their (independent) dependency chains of square roots and divisions
+template<unsigned int N>
+inline void svd3Lanes(glm::dmat3 const *m, glm::dmat3 *u, glm::dvec3 *e, glm::dmat3 *v) {
+
+    // 1. Symmetric eigenproblem transpose(m) * m ////////////////////////////////////////////////////////////////////
+
+    double s[N][3][3];
+    double q[N][4];
+    for (unsigned int l = 0; l < N; l++) {
+        auto mtm = glm::transpose(m[l]) * m[l];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                s[l][i][j] = mtm[j][i];
+            }
+        }
+
+        q[l][0] = 1;
+        q[l][1] = q[l][2] = q[l][3] = 0;
+    }
+
+    for (unsigned int sweep = 0; sweep < numSweeps; sweep++) {
+        for (unsigned int l = 0; l < N; l++) jacobiConjugate(s[l], q[l], 0, 1, 2);
+        for (unsigned int l = 0; l < N; l++) jacobiConjugate(s[l], q[l], 1, 2, 0);
+        for (unsigned int l = 0; l < N; l++) jacobiConjugate(s[l], q[l], 2, 0, 1);
+    }
+
+    glm::dmat3 b[N];
+    for (unsigned int l = 0; l < N; l++) {
+        auto invLen = 1 / std::sqrt(q[l][0] * q[l][0] + q[l][1] * q[l][1] + q[l][2] * q[l][2] + q[l][3] * q[l][3]);
+        auto w = q[l][0] * invLen, x = q[l][1] * invLen, y = q[l][2] * invLen, z = q[l][3] * invLen;
+        v[l] = glm::dmat3(1 - 2 * (y * y + z * z), 2 * (x * y + w * z), 2 * (x * z - w * y),
+                          2 * (x * y - w * z), 1 - 2 * (x * x + z * z), 2 * (y * z + w * x),
+                          2 * (x * z + w * y), 2 * (y * z - w * x), 1 - 2 * (x * x + y * y));
+
+        // 2. Sort the columns of m * v by decreasing norm ///////////////////////////////////////////////////////////
+
+        b[l] = m[l] * v[l];
+        double rho[3] = {glm::dot(b[l][0], b[l][0]), glm::dot(b[l][1], b[l][1]), glm::dot(b[l][2], b[l][2])};
+        sortColumns(b[l], v[l], rho, 0, 1);
+        sortColumns(b[l], v[l], rho, 0, 2);
+        sortColumns(b[l], v[l], rho, 1, 2);
+
+        u[l] = glm::dmat3(1);
+    }
+
+    // 3. QR factorization of m * v, the (nearly) diagonal R holds the singular values ///////////////////////////////
+
+    for (unsigned int l = 0; l < N; l++) qrGivens(b[l], u[l], 0, 1);
+    for (unsigned int l = 0; l < N; l++) qrGivens(b[l], u[l], 0, 2);
+    for (unsigned int l = 0; l < N; l++) qrGivens(b[l], u[l], 1, 2);
+
+    for (unsigned int l = 0; l < N; l++) {
+        e[l] = glm::dvec3(b[l][0][0], b[l][1][1], b[l][2][2]);
+    }
+}
+
+}
+
+inline void svd3(glm::dmat3 const &m, glm::dmat3 &u, glm::dvec3 &e, glm::dmat3 &v) {
+    svd3_detail::svd3Lanes<1>(&m, &u, &e, &v);
+}
+
+/**
+ * Decomposes a batch of n matrices, see svd3 above
+ */
+inline void svd3(unsigned int n, glm::dmat3 const *m, glm::dmat3 *u, glm::dvec3 *e, glm::dmat3 *v) {
+    unsigned int const batchLanes = 4;
+
+    unsigned int i = 0;
+    for (; i + batchLanes <= n; i += batchLanes) {
+        svd3_detail::svd3Lanes<batchLanes>(m + i, u + i, e + i, v + i);
+    }
+    for (; i < n; i++) {
+        svd3(m[i], u[i], e[i], v[i]);
+    }
+}
+
+/**
+ * Clamps the singular values of svd3 to [lo, hi] in magnitude, keeping the sign of a reflection in e.z
+ */
+inline glm::dvec3 clampSingularValues(glm::dvec3 const &e, double lo, double hi) {
+    auto result = glm::clamp(glm::dvec3(e.x, e.y, std::abs(e.z)), lo, hi);
+    result.z = std::copysign(result.z, e.z);
+    return result;
+}
+
+
+#endif //SNOW_SVD3_H
@@ -0,0 +1,69 @@
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include <Dense>
+
+#include "../lib/svd3.h"
+
+
+void launchBenchSvd(int argc, char const **argv) {
+    if (argc < 2) {
+        std::cout << "Usage: ./snow bench-svd [#matrices]" << std::endl;
+        exit(1);
+    }
+
+    unsigned int n = argc > 2 ? static_cast<unsigned int>(std::stoi(argv[2])) : 1000000;
+
+    // Deformation gradients near the identity, like the ones the solvers decompose
+    srand(0);
+    std::vector<glm::dmat3> m(n);
+    for (auto &mi : m) {
+        for (auto i = 0; i < 3; i++) {
+            for (auto j = 0; j < 3; j++) {
+                mi[i][j] = (i == j) + 0.1 * (rand() / (RAND_MAX / 2.0) - 1);
+            }
+        }
+    }
+
+    std::vector<glm::dmat3> u(n), v(n);
+    std::vector<glm::dvec3> e(n);
+
+    // Eigen
+
+    auto timeLast = std::chrono::system_clock::now();
+    for (unsigned int i = 0; i < n; i++) {
+        Eigen::Map<Eigen::Matrix3d const> mmap(&m[i][0][0]);
+        Eigen::Map<Eigen::Matrix3d> umap(&u[i][0][0]);
+        Eigen::Map<Eigen::Vector3d> emap(&e[i][0]);
+        Eigen::Map<Eigen::Matrix3d> vmap(&v[i][0][0]);
+
+        Eigen::JacobiSVD<Eigen::Matrix3d, Eigen::NoQRPreconditioner> svd;
+        svd.compute(mmap, Eigen::ComputeFullV | Eigen::ComputeFullU);
+        umap = svd.matrixU();
+        emap = svd.singularValues();
+        vmap = svd.matrixV();
+    }
+    auto timeNow = std::chrono::system_clock::now();
+    auto eigenMs = std::chrono::duration_cast<std::chrono::milliseconds>(timeNow - timeLast).count();
+
+    auto eigenE = e;
+
+    // svd3 (batched)
+
+    timeLast = std::chrono::system_clock::now();
+    svd3(n, m.data(), u.data(), e.data(), v.data());
+    timeNow = std::chrono::system_clock::now();
+    auto svd3Ms = std::chrono::duration_cast<std::chrono::milliseconds>(timeNow - timeLast).count();
+
+    double maxError = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        maxError = std::max(maxError, glm::length(glm::abs(e[i]) - eigenE[i]));
+    }
+
+    std::cout << "#matrices = " << n << std::endl
+              << "Eigen::JacobiSVD = " << eigenMs << "ms" << std::endl
+              << "svd3 = " << svd3Ms << "ms" << std::endl
+              << "Speedup = " << 1.0 * eigenMs / std::max(svd3Ms, static_cast<decltype(svd3Ms)>(1)) << "x" << std::endl
+              << "Max singular value difference = " << maxError << std::endl;
+}
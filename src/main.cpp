@@ -4,6 +4,8 @@
 
 void launchInfo(int argc, char const **argv);
 
+void launchBenchSvd(int argc, char const **argv);
+
 void launchDemoSnowball(int argc, char const **argv);
 
 void launchDemoDiffSnowball(int argc, char const **argv);
@@ -55,6 +57,7 @@ int main(int argc, char const **argv) {
     std::map<std::string, void (*)(int argc, char const **argv)> routines;
 
     routines.insert(std::make_pair("info", launchInfo));
+    routines.insert(std::make_pair("bench-svd", launchBenchSvd));
 
     // Snow solver
     routines.insert(std::make_pair("sim-gen-snowball", launchSimGenSnowball));
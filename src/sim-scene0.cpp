@@ -1,15 +1,22 @@
+#include <algorithm>
+
 #include "utils/sim.h"
 #include "scenes/scene0.h"
 
 
 void launchSimScene0(int argc, char const **argv) {
     if (argc < 4) {
-        std::cout << "Usage: ./snow sim-scene0 start-frame end-frame" << std::endl;
+        std::cout << "Usage: ./snow sim-scene0 start-frame end-frame [threads]" << std::endl;
         exit(1);
     }
 
     initSim(argc, argv);
 
+    if (argc > 4) {
+        solver->numThreads = static_cast<unsigned int>(std::max(1, std::stoi(argv[4])));
+        solver->parallelRasterization = true;
+    }
+
     solver->handleNodeCollisionVelocityUpdate = handleNodeCollisionVelocityUpdate;
 
     startSimLoop();
@@ -1,15 +1,22 @@
+#include <algorithm>
+
 #include "utils/sim.h"
 #include "scenes/scene1.h"
 
 
 void launchSimScene1(int argc, char const **argv) {
     if (argc < 4) {
-        std::cout << "Usage: ./snow sim-scene1 start-frame end-frame" << std::endl;
+        std::cout << "Usage: ./snow sim-scene1 start-frame end-frame [threads]" << std::endl;
         exit(1);
     }
 
     initSim(argc, argv);
 
+    if (argc > 4) {
+        solver->numThreads = static_cast<unsigned int>(std::max(1, std::stoi(argv[4])));
+        solver->parallelRasterization = true;
+    }
+
     solver->handleNodeCollisionVelocityUpdate = handleNodeCollisionVelocityUpdate;
 
     startSimLoop();
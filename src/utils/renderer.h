@@ -85,9 +85,10 @@ static void updateVizParticlePositions() {
         particles->children[i]->setTranslation(solver->particleNodes[i].position);
 
 #ifdef SOLVER_LAVA
-        if (solver->particleNodes[i].temperature > solver->particleNodes[i].fusionTemperature + FLT_EPSILON) {
+        auto fusionTemperature = solver->materials[solver->particleNodes[i].material].fusionTemperature;
+        if (solver->particleNodes[i].temperature > fusionTemperature + FLT_EPSILON) {
             particles->children[i]->setMaterial(lavaParticleLiquidMaterial);
-        } else if (solver->particleNodes[i].temperature < solver->particleNodes[i].fusionTemperature - FLT_EPSILON) {
+        } else if (solver->particleNodes[i].temperature < fusionTemperature - FLT_EPSILON) {
             particles->children[i]->setMaterial(snowParticleMaterial);
         } else {
             particles->children[i]->setMaterial(lavaParticlePhaseChangeMaterial);
@@ -6,9 +6,16 @@
 #include <boost/test/test_tools.hpp>
 #include <ostream>
 
+#include <Dense>
+
 namespace tt = boost::test_tools;
 
+#include "../lib/CellMultigrid.h"
+#include "../lib/RedBlackSOR.h"
 #include "../lib/conjugate_residual_solver.h"
+#include "../lib/g2p.h"
+#include "../lib/morton.h"
+#include "../lib/svd3.h"
 #include "../lib/SnowSolver.h"
 #include "../lib/LavaSolver.h"
 
@@ -20,6 +27,18 @@ void A(std::vector<double> &Ax, std::vector<double> const &x) {
     Ax[2] = x[0] + x[1] + 2 * x[2];
 }
 
+// C[1x1]
+void C(std::vector<double> &Ax, std::vector<double> const &x) {
+    Ax[0] = 2 * x[0];
+}
+
+// D[3x3] = W^-1 S with W = diag(1, 2, 4) and S symmetric
+void D(std::vector<double> &Ax, std::vector<double> const &x) {
+    Ax[0] = 3 * x[0] + x[1];
+    Ax[1] = (x[0] + 6 * x[1] + 2 * x[2]) / 2;
+    Ax[2] = (2 * x[1] + 12 * x[2]) / 4;
+}
+
 // B[3x3]
 void B(std::vector<glm::dvec3> &Ax, std::vector<glm::dvec3> const &x) {
     Ax[0] = glm::dmat3(2, 1, 1, 1, 2, 1, 1, 1, 2) * x[0];
@@ -73,6 +92,224 @@ BOOST_AUTO_TEST_SUITE(test_conjugate_gradient_method)
 
     }
 
+    BOOST_AUTO_TEST_CASE(solver_reuse) {
+
+        // Workspace kept across solves of different sizes
+        ConjugateResidualSolver<double> solver;
+
+        std::vector<double> b = {1, 1, 1};
+        std::vector<double> x = {0, 0, 0};
+        solver.solve(A, x, b, 2000);
+
+        std::vector<double> b1 = {1};
+        std::vector<double> x1 = {0};
+        solver.solve(C, x1, b1, 2000);
+
+        x = {0, 0, 0};
+        solver.solve(A, x, b, 2000);
+
+        BOOST_TEST(x[0] == 0.25);
+        BOOST_TEST(x[1] == 0.25);
+        BOOST_TEST(x[2] == 0.25);
+        BOOST_TEST(x1[0] == 0.5);
+
+    }
+
+    BOOST_AUTO_TEST_CASE(preconditioned) {
+
+        ConjugateResidualSolver<double> solver;
+
+        std::vector<double> b = {1, 1, 1};
+        std::vector<double> x = {0, 0, 0};
+        std::vector<double> inverseDiagonal = {0.5, 0.5, 0.5};
+        solver.solve(A, inverseDiagonal, x, b, 2000);
+
+        BOOST_TEST(x[0] == 0.25, tt::tolerance(1e-6));
+        BOOST_TEST(x[1] == 0.25, tt::tolerance(1e-6));
+        BOOST_TEST(x[2] == 0.25, tt::tolerance(1e-6));
+
+        // D is only self-adjoint in the inner product weighted by {1, 2, 4}
+        std::vector<double> weights = {1, 2, 4};
+        inverseDiagonal = {1 / 3.0, 1 / 3.0, 1 / 3.0};
+        x = {0, 0, 0};
+        auto result = solver.solve(D, inverseDiagonal, x, b, 2000, &weights);
+
+        std::vector<double> Dx(3);
+        D(Dx, x);
+
+        BOOST_TEST(Dx[0] == 1, tt::tolerance(1e-6));
+        BOOST_TEST(Dx[1] == 1, tt::tolerance(1e-6));
+        BOOST_TEST(Dx[2] == 1, tt::tolerance(1e-6));
+        BOOST_TEST(result.iterations <= 3);
+
+    }
+
+    BOOST_AUTO_TEST_CASE(callable_and_report) {
+
+        ConjugateResidualSolver<double> solver;
+
+        // diag(1, 2, 3), needs 3 iterations
+        auto E = [](std::vector<double> &Ax, std::vector<double> const &x) {
+            for (auto i = 0; i < 3; i++) {
+                Ax[i] = (i + 1) * x[i];
+            }
+        };
+
+        std::vector<double> b = {1, 1, 1};
+        std::vector<double> x = {0, 0, 0};
+        auto result = solver.solve(E, x, b, 1);
+
+        BOOST_TEST(result.iterations == 1);
+        BOOST_TEST(result.termination == ConjugateResidualResult::MAX_ITERATIONS);
+        BOOST_TEST(result.initialResidual == std::sqrt(3.0), tt::tolerance(1e-12));
+
+        x = {0, 0, 0};
+        result = solver.solve(E, x, b, 2000);
+
+        BOOST_TEST(result.termination == ConjugateResidualResult::CONVERGED);
+        BOOST_TEST(result.finalResidual < solver.absoluteTolerance);
+        BOOST_TEST(x[2] == 1 / 3.0, tt::tolerance(1e-6));
+
+        solver.relativeTolerance = 0.5;
+        x = {0, 0, 0};
+        result = solver.solve(E, x, b, 2000);
+
+        BOOST_TEST(result.termination == ConjugateResidualResult::CONVERGED);
+        BOOST_TEST(result.finalResidual < 0.5 * result.initialResidual);
+        BOOST_TEST(result.iterations < 3);
+
+    }
+
+BOOST_AUTO_TEST_SUITE_END()
+
+
+// Negative Laplacian on an n^3 grid with coefficients varying across x, on the cells of a ball and a slab under it, 0
+// outside the cells and no flux through the grid boundary
+static void genTestStencilMatrix(StencilMatrix &A, std::vector<glm::uvec3> &locations, unsigned int n) {
+    static glm::ivec3 const offsets[6] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+
+    std::vector<int> rows(n * n * n, -1);
+    locations.clear();
+    for (unsigned int x = 0; x < n; x++) {
+        for (unsigned int y = 0; y < n; y++) {
+            for (unsigned int z = 0; z < n; z++) {
+                auto d = glm::dvec3(x, y, z) + glm::dvec3(0.5) - glm::dvec3(n / 2.0);
+                if (glm::length(d) < n / 2.0 || z < n / 4) {
+                    rows[(x * n + y) * n + z] = static_cast<int>(locations.size());
+                    locations.emplace_back(x, y, z);
+                }
+            }
+        }
+    }
+
+    A.reset(locations.size());
+    for (auto a = 0; a < locations.size(); a++) {
+        for (auto k = 0; k < 6; k++) {
+            auto neighbor = glm::ivec3(locations[a]) + offsets[k];
+            if (glm::min(neighbor, glm::ivec3(0)) != glm::ivec3(0) || neighbor.x >= n || neighbor.y >= n ||
+                neighbor.z >= n)
+                continue;
+
+            auto coefficient = (neighbor.x + locations[a].x) % 4 == 0 ? 10.0 : 1.0;
+            A[a].diagonal += coefficient;
+
+            auto b = rows[(neighbor.x * n + neighbor.y) * n + neighbor.z];
+            if (b >= 0) {
+                A[a].neighbors[k] = b;
+                A[a].coefficients[k] = -coefficient;
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(test_multigrid)
+
+    BOOST_AUTO_TEST_CASE(poisson) {
+
+        StencilMatrix A;
+        std::vector<glm::uvec3> locations;
+        genTestStencilMatrix(A, locations, 16);
+
+        CellMultigrid multigrid;
+        multigrid.setup(A, locations, glm::uvec3(16));
+        BOOST_TEST(multigrid.getNumLevels() > 2);
+
+        srand(0);
+        std::vector<double> b(A.size());
+        for (auto &value : b) {
+            value = rand() / (RAND_MAX / 2.0) - 1;
+        }
+
+        auto applyA = [&](std::vector<double> &Ax, std::vector<double> const &x) {
+            A.apply(Ax, x);
+        };
+
+        ConjugateResidualSolver<double> solver;
+        solver.absoluteTolerance = 1e-8;
+
+        std::vector<double> x(A.size());
+        auto unpreconditioned = solver.solve(applyA, x, b, 2000);
+
+        x.assign(A.size(), 0);
+        auto preconditioned = solver.solve(applyA, [&](std::vector<double> &z, std::vector<double> const &r) {
+            multigrid.vcycle(z, r);
+        }, x, b, 2000);
+
+        BOOST_TEST(preconditioned.termination == ConjugateResidualResult::CONVERGED);
+        BOOST_TEST(preconditioned.iterations * 4 < unpreconditioned.iterations);
+
+        x.assign(A.size(), 0);
+        auto cycles = multigrid.solve(x, b, 200, 0, 1e-8);
+
+        BOOST_TEST(cycles.termination == ConjugateResidualResult::CONVERGED);
+
+        std::vector<double> Ax(A.size());
+        A.apply(Ax, x);
+        for (auto a = 0; a < A.size(); a++) {
+            BOOST_TEST(std::abs(Ax[a] - b[a]) < 1e-6);
+        }
+
+    }
+
+    BOOST_AUTO_TEST_CASE(red_black_sor) {
+
+        StencilMatrix A;
+        std::vector<glm::uvec3> locations;
+        genTestStencilMatrix(A, locations, 8);
+
+        std::vector<double> b(A.size(), 1);
+
+        RedBlackSOR sor;
+        sor.setup(locations);
+        sor.relaxationFactor = 1.5;
+
+        std::vector<double> x(A.size());
+        auto result = sor.solve(A, x, b, 2000, 0, 1e-8);
+
+        BOOST_TEST(result.termination == ConjugateResidualResult::CONVERGED);
+
+        // Cells of one color are independent, threads don't change the result
+        sor.numThreads = 4;
+        std::vector<double> x4(A.size());
+        sor.solve(A, x4, b, result.iterations, 0, 0);
+
+        for (auto a = 0; a < A.size(); a++) {
+            BOOST_TEST(x4[a] == x[a]);
+        }
+
+        // As a multigrid smoother
+        CellMultigrid multigrid;
+        multigrid.smoother = CellMultigrid::RED_BLACK_GAUSS_SEIDEL;
+        multigrid.setup(A, locations, glm::uvec3(8));
+
+        x.assign(A.size(), 0);
+        auto cycles = multigrid.solve(x, b, 200, 0, 1e-8);
+
+        BOOST_TEST(cycles.termination == ConjugateResidualResult::CONVERGED);
+        BOOST_TEST(cycles.iterations < result.iterations);
+
+    }
+
 BOOST_AUTO_TEST_SUITE_END()
 
 
@@ -184,17 +421,179 @@ BOOST_AUTO_TEST_SUITE(test_n)
 
     }
 
+    BOOST_AUTO_TEST_CASE(stencil_weights) {
+
+        auto h = 0.02;
+        auto position = glm::dvec3(0.1234, 0.5678, 0.9012);
+        auto offset = glm::dvec3(0, -0.5, 0);
+        auto gmin = glm::ivec3(position / h - glm::dvec3(1, 0.5, 1));
+
+        StencilWeights<CubicBSpline> weights;
+        weights.compute(position, gmin, offset, h, 1 / h);
+        StencilWeights<QuadraticBSpline> tightWeights;
+        tightWeights.compute(position, gmin, offset, h, 1 / h);
+
+        for (unsigned int i = 0; i < 64; i++) {
+            auto d = (position - (glm::dvec3(gmin + glm::ivec3(i / 16, (i / 4) % 4, i % 4)) + offset) * h) / h;
+
+            BOOST_TEST(weights.weight(i) == SnowSolver::n(d.x) * SnowSolver::n(d.y) * SnowSolver::n(d.z),
+                       tt::tolerance(1e-12));
+            BOOST_TEST(weights.nabla_weight(i).y ==
+                       SnowSolver::n(d.x) * SnowSolver::del_n(d.y) * SnowSolver::n(d.z) / h,
+                       tt::tolerance(1e-12));
+            BOOST_TEST(tightWeights.weight(i) ==
+                       LavaSolver::tight_n(d.x) * LavaSolver::tight_n(d.y) * LavaSolver::tight_n(d.z),
+                       tt::tolerance(1e-12));
+        }
+
+
+        // The quadratic kernel only needs the 27 nodes from floor(x - offset - 0.5) on, the other ones weigh nothing
+        auto tightGmin = glm::ivec3(position / h - offset - glm::dvec3(0.5));
+        StencilWeights<QuadraticBSpline, 3> tightWeights27;
+        tightWeights27.compute(position, tightGmin, offset, h, 1 / h);
+
+        for (unsigned int i = 0; i < tightWeights27.numNodes; i++) {
+            auto d = (position - (glm::dvec3(tightGmin + glm::ivec3(i / 9, (i / 3) % 3, i % 3)) + offset) * h) / h;
+
+            BOOST_TEST(tightWeights27.weight(i) ==
+                       LavaSolver::tight_n(d.x) * LavaSolver::tight_n(d.y) * LavaSolver::tight_n(d.z),
+                       tt::tolerance(1e-12));
+        }
+
+        for (unsigned int i = 0; i < 64; i++) {
+            auto l = gmin + glm::ivec3(i / 16, (i / 4) % 4, i % 4) - tightGmin;
+            if (l.x >= 0 && l.y >= 0 && l.z >= 0 && l.x < 3 && l.y < 3 && l.z < 3) {
+                BOOST_TEST(tightWeights.weight(i) == tightWeights27.weight((l.x * 3 + l.y) * 3 + l.z),
+                           tt::tolerance(1e-12));
+            } else {
+                BOOST_TEST(tightWeights.weight(i) == 0);
+                BOOST_TEST((tightWeights.nabla_weight(i) == glm::dvec3(0)));
+            }
+        }
+
+    }
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(test_svd3)
+
+    BOOST_AUTO_TEST_CASE(against_eigen) {
+
+        std::vector<glm::dmat3> ms;
+
+        srand(0);
+        for (auto t = 0; t < 1000; t++) {
+            glm::dmat3 m;
+            for (auto i = 0; i < 3; i++) {
+                m[i] = glm::dvec3(rand() / (RAND_MAX / 2.0) - 1,
+                                  rand() / (RAND_MAX / 2.0) - 1,
+                                  rand() / (RAND_MAX / 2.0) - 1);
+            }
+            if (t % 4 == 1) m = glm::dmat3(1) + 1e-3 * m; // Nearly repeated singular values
+            if (t % 4 == 2) m[2] = m[0] + 1e-9 * m[1]; // Nearly singular
+            if (t % 4 == 3) m[0] = -m[0]; // Reflection
+            ms.push_back(m);
+        }
+
+        // Shear plus stretch with exactly equal, decoupled diagonal entries in m^T m
+        ms.emplace_back(glm::dvec3(1, 0, 0), glm::dvec3(0, 1, 0), glm::dvec3(1, 1, 1));
+        ms.emplace_back(glm::dvec3(1, 0, 0), glm::dvec3(0, 1, 0), glm::dvec3(0.3, 0.2, 1.1));
+        ms.emplace_back(glm::dvec3(1, 0, 0), glm::dvec3(0, 1, 0), glm::dvec3(0, 0, 1));
+        ms.emplace_back(glm::dvec3(2, 0, 0), glm::dvec3(0, 2, 0), glm::dvec3(0, 0, 0.5));
+
+        for (auto const &m : ms) {
+            glm::dmat3 u, v;
+            glm::dvec3 e;
+            svd3(m, u, e, v);
+
+            Eigen::Map<Eigen::Matrix3d const> mmap(&m[0][0]);
+            Eigen::JacobiSVD<Eigen::Matrix3d, Eigen::NoQRPreconditioner> svd(mmap);
+            auto sv = svd.singularValues();
+
+            BOOST_TEST(std::abs(e.x) == sv[0], tt::tolerance(1e-10));
+            BOOST_TEST(std::abs(e.y) == sv[1], tt::tolerance(1e-10));
+            BOOST_TEST(std::abs(e.z) - sv[2] == 0, tt::tolerance(1e-10));
+
+            auto r = u * glm::dmat3(e.x, 0, 0, 0, e.y, 0, 0, 0, e.z) * glm::transpose(v) - m;
+            auto uut = u * glm::transpose(u) - glm::dmat3(1);
+            auto vvt = v * glm::transpose(v) - glm::dmat3(1);
+            for (auto i = 0; i < 3; i++) {
+                for (auto j = 0; j < 3; j++) {
+                    BOOST_TEST(r[i][j] == 0, tt::tolerance(1e-12));
+                    BOOST_TEST(uut[i][j] == 0, tt::tolerance(1e-12));
+                    BOOST_TEST(vvt[i][j] == 0, tt::tolerance(1e-12));
+                }
+            }
+            BOOST_TEST(glm::determinant(u) == 1, tt::tolerance(1e-12));
+            BOOST_TEST(glm::determinant(v) == 1, tt::tolerance(1e-12));
+        }
+
+    }
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(test_g2p)
+
+    BOOST_AUTO_TEST_CASE(kernels_match_reference) {
+
+        srand(0);
+        auto h = 0.02;
+        auto position = glm::dvec3(0.5123, 0.4871, 0.5032);
+        auto gmin = glm::ivec3((position / h) - glm::dvec3(1));
+
+        StencilWeights<CubicBSpline> weights{};
+        weights.compute(position, gmin, glm::dvec3(0), h, 1 / h);
+
+        G2PStencil stencil{};
+        for (auto k = 0; k < 3; k++) {
+            for (auto i = 0; i < 64; i++) {
+                stencil.velocity[k][i] = rand() / (RAND_MAX / 2.0) - 1;
+                stencil.velocity_star[k][i] = rand() / (RAND_MAX / 2.0) - 1;
+            }
+        }
+
+        // Reference, as written out in the solver before the kernels
+        glm::dmat3 nabla_v{};
+        glm::dvec3 v_pic{};
+        glm::dvec3 delta_v{};
+        for (auto i = 0; i < 64; i++) {
+            auto gv = glm::dvec3(stencil.velocity[0][i], stencil.velocity[1][i], stencil.velocity[2][i]);
+            auto gv1 = glm::dvec3(stencil.velocity_star[0][i], stencil.velocity_star[1][i],
+                                  stencil.velocity_star[2][i]);
+            nabla_v += glm::outerProduct(gv1, weights.nabla_weight(i));
+            v_pic += gv1 * weights.weight(i);
+            delta_v += (gv1 - gv) * weights.weight(i);
+        }
+
+        for (auto kernel : {G2P_SCALAR, G2P_AVX2, G2P_AVX512}) {
+            if (!isG2PKernelSupported(kernel)) continue;
+
+            G2PTransfer transfer{};
+            g2p(kernel, weights, stencil, transfer);
+
+            for (auto j = 0; j < 3; j++) {
+                for (auto k = 0; k < 3; k++) {
+                    BOOST_TEST(transfer.nabla_v[j][k] == nabla_v[j][k], tt::tolerance(1e-12));
+                }
+                BOOST_TEST(transfer.v_pic[j] == v_pic[j], tt::tolerance(1e-12));
+                BOOST_TEST(transfer.delta_v[j] == delta_v[j], tt::tolerance(1e-12));
+            }
+        }
+
+    }
+
 BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_AUTO_TEST_SUITE(test_temperature)
 
     BOOST_AUTO_TEST_CASE(test_small_increments) {
 
+        LavaMaterial water;
         LavaParticleNode node({}, 1);
         node.temperature = 20;
 
         while (node.temperature < 50) {
-            LavaSolver::applyTemperatureDifference(node, 1);
+            LavaSolver::applyTemperatureDifference(node, water, 1);
             std::cout << node.temperature << " " << node.latentHeat << std::endl;
         }
 
@@ -202,11 +601,12 @@ BOOST_AUTO_TEST_SUITE(test_temperature)
 
     BOOST_AUTO_TEST_CASE(test_large_increments) {
 
+        LavaMaterial water;
         LavaParticleNode node({}, 1);
         node.temperature = 20;
 
         while (node.temperature < 50) {
-            LavaSolver::applyTemperatureDifference(node, 50);
+            LavaSolver::applyTemperatureDifference(node, water, 50);
             std::cout << node.temperature << " " << node.latentHeat << std::endl;
         }
 
@@ -214,11 +614,12 @@ BOOST_AUTO_TEST_SUITE(test_temperature)
 
     BOOST_AUTO_TEST_CASE(test_small_decrements) {
 
+        LavaMaterial water;
         LavaParticleNode node({}, 1);
         node.temperature = 50;
 
         while (node.temperature > 20) {
-            LavaSolver::applyTemperatureDifference(node, -1);
+            LavaSolver::applyTemperatureDifference(node, water, -1);
             std::cout << node.temperature << " " << node.latentHeat << std::endl;
         }
 
@@ -226,14 +627,408 @@ BOOST_AUTO_TEST_SUITE(test_temperature)
 
     BOOST_AUTO_TEST_CASE(test_large_decrements) {
 
+        LavaMaterial water;
         LavaParticleNode node({}, 1);
         node.temperature = 50;
 
         while (node.temperature > 20) {
-            LavaSolver::applyTemperatureDifference(node, -50);
+            LavaSolver::applyTemperatureDifference(node, water, -50);
             std::cout << node.temperature << " " << node.latentHeat << std::endl;
         }
 
     }
 
 BOOST_AUTO_TEST_SUITE_END()
+
+static void genTestSnowball(SnowSolver &solver, unsigned int numParticles) {
+    srand(0);
+    while (solver.particleNodes.size() < numParticles) {
+        auto position = glm::dvec3(0.5) + 0.1 * glm::dvec3(rand() / (RAND_MAX / 2.0) - 1,
+                                                           rand() / (RAND_MAX / 2.0) - 1,
+                                                           rand() / (RAND_MAX / 2.0) - 1);
+        if (glm::length(position - glm::dvec3(0.5)) > 0.1) continue;
+        solver.particleNodes.emplace_back(position, 400 * pow(0.01, 3));
+    }
+    solver.handleNodeCollisionVelocityUpdate = nullptr;
+}
+
+// Sticky floor under the test snowball
+static void handleTestFloorCollision(Node &node) {
+    if (node.position.z <= 0.42 && node.velocity_star.z < 0) {
+        node.velocity_star = glm::dvec3(0);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(test_snow_solver)
+
+    BOOST_AUTO_TEST_CASE(parallel_rasterization_deterministic) {
+
+        SnowSolver a(0.02, glm::uvec3(50));
+        SnowSolver b(0.02, glm::uvec3(50));
+        genTestSnowball(a, 2000);
+        genTestSnowball(b, 2000);
+
+        a.parallelRasterization = true;
+        a.numThreads = 1;
+        b.parallelRasterization = true;
+        b.numThreads = 4;
+
+        for (auto tick = 0; tick < 3; tick++) {
+            a.update();
+            b.update();
+        }
+
+        for (auto p = 0; p < a.particleNodes.size(); p++) {
+            BOOST_TEST((a.particleNodes[p].position == b.particleNodes[p].position));
+            BOOST_TEST((a.particleNodes[p].velocity == b.particleNodes[p].velocity));
+        }
+
+    }
+
+    BOOST_AUTO_TEST_CASE(parallel_implicit_solve_deterministic) {
+
+        SnowSolver a(0.02, glm::uvec3(50));
+        SnowSolver b(0.02, glm::uvec3(50));
+        genTestSnowball(a, 2000);
+        genTestSnowball(b, 2000);
+
+        a.beta = 1;
+        a.parallelImplicitSolve = true;
+        a.numThreads = 1;
+        b.beta = 1;
+        b.parallelImplicitSolve = true;
+        b.numThreads = 4;
+
+        for (auto tick = 0; tick < 3; tick++) {
+            a.update();
+            b.update();
+            BOOST_TEST(a.implicitSolveResult.iterations == b.implicitSolveResult.iterations);
+        }
+
+        for (auto p = 0; p < a.particleNodes.size(); p++) {
+            BOOST_TEST((a.particleNodes[p].position == b.particleNodes[p].position));
+            BOOST_TEST((a.particleNodes[p].velocity == b.particleNodes[p].velocity));
+        }
+
+    }
+
+    BOOST_AUTO_TEST_CASE(morton_sorted_frames_line_up) {
+
+        SnowSolver solver(0.02, glm::uvec3(50));
+        genTestSnowball(solver, 2000);
+        solver.sortInterval = 1;
+        solver.delta_t = 0; // Keep particles in the cells they were sorted by
+        solver.update();
+
+        BOOST_TEST(solver.particleIds.size() == solver.particleNodes.size());
+        for (auto p = 1; p < solver.particleNodes.size(); p++) {
+            auto cell0 = glm::uvec3(solver.particleNodes[p - 1].position / solver.h);
+            auto cell1 = glm::uvec3(solver.particleNodes[p].position / solver.h);
+            BOOST_TEST(mortonKey(cell0) <= mortonKey(cell1));
+        }
+
+        solver.saveState("test-morton.snowstate");
+        SnowSolver loaded("test-morton.snowstate");
+        std::remove("test-morton.snowstate");
+
+        for (auto p = 0; p < solver.particleNodes.size(); p++) {
+            auto const &particleNode = loaded.particleNodes[solver.particleIds[p]];
+            BOOST_TEST((particleNode.position == solver.particleNodes[p].position));
+        }
+
+    }
+
+    BOOST_AUTO_TEST_CASE(warm_started_implicit_solve) {
+
+        SnowSolver cold(0.02, glm::uvec3(50));
+        SnowSolver warm(0.02, glm::uvec3(50));
+        genTestSnowball(cold, 2000);
+        genTestSnowball(warm, 2000);
+
+        // Resting on the floor, the snowball is stressed and the solves take many iterations
+        for (auto solver : {&cold, &warm}) {
+            solver->handleNodeCollisionVelocityUpdate = handleTestFloorCollision;
+            solver->beta = 1;
+        }
+        warm.warmStartImplicitSolve = true;
+
+        auto coldIterations = 0;
+        auto warmIterations = 0;
+        for (auto tick = 0; tick < 5; tick++) {
+            cold.update();
+            warm.update();
+            coldIterations += cold.implicitSolveResult.iterations;
+            warmIterations += warm.implicitSolveResult.iterations;
+            BOOST_TEST(warm.implicitSolveResult.termination == ConjugateResidualResult::CONVERGED);
+        }
+
+        BOOST_TEST_MESSAGE("iterations cold=" << coldIterations << " warm=" << warmIterations);
+        BOOST_TEST(warmIterations < coldIterations);
+
+        for (auto p = 0; p < cold.particleNodes.size(); p++) {
+            BOOST_TEST(glm::length(warm.particleNodes[p].velocity - cold.particleNodes[p].velocity) < 1e-3);
+        }
+
+    }
+
+    BOOST_AUTO_TEST_CASE(inverted_particle_plasticity) {
+
+        SnowSolver solver(0.02, glm::uvec3(50));
+        genTestSnowball(solver, 200);
+        solver.delta_t = 1e-5;
+        solver.particleNodes.deformElastic[0] = glm::dmat3(1, 0, 0, 0, 1, 0, 0, 0, -1);
+
+        solver.update();
+
+        // The reflection stays in the elastic part
+        auto je = glm::determinant(solver.particleNodes.deformElastic[0]);
+        auto jp = glm::determinant(solver.particleNodes.deformPlastic[0]);
+        BOOST_TEST(je < 0);
+        BOOST_TEST(jp > 0);
+        BOOST_TEST(std::isfinite(je * jp));
+
+    }
+
+    BOOST_AUTO_TEST_CASE(unallocated_grid_nodes) {
+
+        SnowSolver solver(0.02, glm::uvec3(50));
+        genTestSnowball(solver, 200);
+        solver.update();
+
+        // Far from the snowball, nodes read as untouched ones
+        auto &gridNode = solver.gridNode(1, 2, 3);
+        BOOST_TEST((gridNode.location == glm::uvec3(1, 2, 3)));
+        BOOST_TEST((gridNode.position == glm::dvec3(0.02, 0.04, 0.06)));
+        BOOST_TEST(gridNode.mass == 0);
+        BOOST_TEST((gridNode.velocity == glm::dvec3()));
+
+        gridNode.mass = 1;
+        BOOST_TEST(solver.gridNode(1, 2, 3).mass == 0);
+
+    }
+
+    BOOST_AUTO_TEST_CASE(warm_start_cache_remap) {
+
+        WarmStartCache<double> cache;
+        std::vector<unsigned int> keys = {7, 3, 5};
+        cache.store(std::vector<double>{70, 30, 50}, [&](size_t a) { return keys[a]; });
+
+        // Node 7 became inactive, node 4 active
+        keys = {3, 4, 5};
+        std::vector<double> x = {0, -1, 0};
+        auto numLoaded = cache.load(x, [&](size_t a) { return keys[a]; });
+
+        BOOST_TEST(numLoaded == 2);
+        BOOST_TEST(x[0] == 30);
+        BOOST_TEST(x[1] == -1);
+        BOOST_TEST(x[2] == 50);
+
+    }
+
+    BOOST_AUTO_TEST_CASE(particle_node_views) {
+
+        SnowParticleNodes particleNodes;
+        particleNodes.emplace_back(glm::dvec3(1, 2, 3), 4);
+        particleNodes.emplace_back(glm::dvec3(5, 6, 7), 8);
+
+        particleNodes[1].velocity = glm::dvec3(1, 0, 0);
+        BOOST_TEST((particleNodes.velocity[1] == glm::dvec3(1, 0, 0)));
+        BOOST_TEST((particleNodes.deformElastic[1] == glm::dmat3(1)));
+
+        SnowParticleNode particleNode = particleNodes[1];
+        particleNode.mass = 9;
+        particleNodes[0] = particleNode;
+        BOOST_TEST(particleNodes.mass[0] == 9);
+        BOOST_TEST((particleNodes[0].position == glm::dvec3(5, 6, 7)));
+
+        particleNodes.reorder({1, 0});
+        BOOST_TEST(particleNodes.mass[0] == 8);
+        BOOST_TEST(particleNodes.mass[1] == 9);
+
+    }
+
+    BOOST_AUTO_TEST_CASE(particle_footprint) {
+
+        // Large scenes (5M particles) rely on particles staying small, stencil weights live in the solver
+        BOOST_TEST(sizeof(SnowParticleNode) <= 256);
+
+    }
+
+BOOST_AUTO_TEST_SUITE_END()
+
+static void genTestLavaBall(LavaSolver &solver, unsigned int numParticles, glm::dvec3 const &center,
+                            glm::dvec3 const &radius, double temperature, bool floor) {
+    srand(0);
+    while (solver.particleNodes.size() < numParticles) {
+        auto offset = radius * glm::dvec3(rand() / (RAND_MAX / 2.0) - 1,
+                                          rand() / (RAND_MAX / 2.0) - 1,
+                                          rand() / (RAND_MAX / 2.0) - 1);
+        if (glm::length(offset / radius) > 1) continue;
+        solver.particleNodes.emplace_back(center + offset, 1000 * pow(0.005, 3));
+        solver.particleNodes.back().temperature = temperature;
+    }
+    if (floor) {
+        solver.isNodeColliding = [](Node &node) { return node.position.z < 0.05; };
+    } else {
+        solver.isNodeColliding = [](Node &) { return false; };
+    }
+    solver.handleNodeCollisionVelocityUpdate = [](Node &) {};
+    solver.delta_t = 5e-4;
+}
+
+BOOST_AUTO_TEST_SUITE(test_lava_solver)
+
+    BOOST_AUTO_TEST_CASE(material_table_frames) {
+
+        LavaSolver solver(0.02, glm::uvec3(10));
+        solver.materials.resize(2);
+        solver.materials[1].fusionTemperature = 1200;
+        solver.materials[1].specificHeat = 1.2e3;
+
+        for (auto p = 0; p < 10; p++) {
+            solver.particleNodes.emplace_back(glm::dvec3(0.1, 0.1, 0.01 * p + 0.05), 1);
+            solver.particleNodes.back().material = static_cast<unsigned short>(p % 2);
+        }
+
+        solver.saveState("test-materials.lavastate");
+        LavaSolver loaded("test-materials.lavastate");
+        std::remove("test-materials.lavastate");
+
+        BOOST_TEST(loaded.materials.size() == 2);
+        BOOST_TEST(loaded.materials[1].fusionTemperature == 1200);
+        BOOST_TEST(loaded.materials[1].specificHeat == 1.2e3);
+        BOOST_TEST(loaded.materials[0].fusionTemperature == 0);
+        for (auto p = 0; p < 10; p++) {
+            BOOST_TEST(loaded.particleNodes[p].material == p % 2);
+        }
+
+    }
+
+    BOOST_AUTO_TEST_CASE(invalid_frame_materials) {
+
+        // Particles refer to a material missing from the saved table
+        LavaSolver solver(0.02, glm::uvec3(10));
+        solver.particleNodes.emplace_back(glm::dvec3(0.1), 1);
+        solver.particleNodes.back().material = 3;
+
+        solver.saveState("test-invalid-materials.lavastate");
+        LavaSolver loaded("test-invalid-materials.lavastate");
+        std::remove("test-invalid-materials.lavastate");
+
+        BOOST_TEST(loaded.materials.size() == 1);
+        BOOST_TEST(loaded.particleNodes[0].material == 0);
+
+    }
+
+    BOOST_AUTO_TEST_CASE(parallel_rasterization_deterministic) {
+
+        LavaSolver a(0.02, glm::uvec3(20));
+        LavaSolver b(0.02, glm::uvec3(20));
+        for (auto solver : {&a, &b}) {
+            genTestLavaBall(*solver, 2000, glm::dvec3(0.2), glm::dvec3(0.1), 10, false);
+            solver->parallelRasterization = true;
+        }
+        a.numThreads = 1;
+        b.numThreads = 4;
+
+        for (auto tick = 0; tick < 3; tick++) {
+            a.update();
+            b.update();
+        }
+
+        for (auto p = 0; p < a.particleNodes.size(); p++) {
+            BOOST_TEST((a.particleNodes[p].position == b.particleNodes[p].position));
+            BOOST_TEST((a.particleNodes[p].velocity == b.particleNodes[p].velocity));
+            BOOST_TEST(a.particleNodes[p].temperature == b.particleNodes[p].temperature);
+        }
+
+    }
+
+    BOOST_AUTO_TEST_CASE(cell_type_masks) {
+
+        // Rows of 70 cells span two words
+        LavaSolver solver(0.01, glm::uvec3(8, 6, 70));
+        genTestLavaBall(solver, 3000, glm::dvec3(0.04, 0.03, 0.35), glm::dvec3(0.03, 0.02, 0.3), -1, true);
+        solver.update();
+
+        auto numTypes = glm::uvec3(0);
+        for (unsigned int x = 0; x < 8; x++) {
+            for (unsigned int y = 0; y < 6; y++) {
+                for (unsigned int z = 0; z < 70; z++) {
+                    LavaGridFaceNode *faces[6] = {
+                            &solver.gridFaceXNode(x, y, z), &solver.gridFaceXNode(x + 1, y, z),
+                            &solver.gridFaceYNode(x, y, z), &solver.gridFaceYNode(x, y + 1, z),
+                            &solver.gridFaceZNode(x, y, z), &solver.gridFaceZNode(x, y, z + 1)
+                    };
+                    auto colliding = true;
+                    auto interior = true;
+                    for (auto face : faces) {
+                        colliding &= face->colliding;
+                        interior &= face->mass > 0;
+                    }
+
+                    auto type = colliding ? COLLIDING : interior ? INTERIOR : EMPTY;
+                    numTypes[type]++;
+                    BOOST_TEST(solver.isGridCellNodeType(x, y, z, EMPTY) == (type == EMPTY));
+                    BOOST_TEST(solver.isGridCellNodeType(x, y, z, COLLIDING) == (type == COLLIDING));
+                    BOOST_TEST(solver.isGridCellNodeType(x, y, z, INTERIOR) == (type == INTERIOR));
+                }
+            }
+        }
+
+        BOOST_TEST(numTypes[COLLIDING] > 0);
+        BOOST_TEST(numTypes[INTERIOR] > 0);
+        BOOST_TEST(solver.getGridCellNodeMask(EMPTY).count() == numTypes[EMPTY]);
+
+    }
+
+    BOOST_AUTO_TEST_CASE(inverted_particle_plasticity) {
+
+        LavaSolver solver(0.02, glm::uvec3(20));
+        genTestLavaBall(solver, 200, glm::dvec3(0.2), glm::dvec3(0.1), -10, false);
+        solver.particleNodes[0].deformElastic = glm::dmat3(1, 0, 0, 0, 1, 0, 0, 0, -1);
+
+        solver.update();
+
+        // The reflection stays in the elastic part
+        auto je = glm::determinant(solver.particleNodes[0].deformElastic);
+        auto jp = glm::determinant(solver.particleNodes[0].deformPlastic);
+        BOOST_TEST(je < 0);
+        BOOST_TEST(jp > 0);
+        BOOST_TEST(std::isfinite(je * jp));
+
+    }
+
+    BOOST_AUTO_TEST_CASE(heat_boundary_temperature) {
+
+        for (auto heatSolver : {CONJUGATE_RESIDUAL, RED_BLACK_SOR}) {
+            for (auto hold : {false, true}) {
+                LavaSolver solver(0.02, glm::uvec3(10));
+                genTestLavaBall(solver, 1000, glm::dvec3(0.1, 0.1, 0.11), glm::dvec3(0.04), 10, true);
+                solver.heatSolver = heatSolver;
+                solver.holdHeatBoundaryTemperature = hold;
+                solver.update();
+
+                // Massless colliding cells are at 200 degC, only conjugate residual lets them drift unless held
+                auto numBoundaryCells = 0;
+                auto numHeldCells = 0;
+                solver.getGridCellNodeMask(COLLIDING).forEachSetBit([&](size_t row, size_t z) {
+                    auto const &cellNode = solver.gridCellNode(row / 10, row % 10, z);
+                    if (cellNode.mass != 0) return;
+
+                    numBoundaryCells++;
+                    if (cellNode.temperature_next == 200) numHeldCells++;
+                });
+
+                BOOST_TEST(numBoundaryCells > 0);
+                if (hold || heatSolver != CONJUGATE_RESIDUAL) {
+                    BOOST_TEST(numHeldCells == numBoundaryCells);
+                } else {
+                    BOOST_TEST(numHeldCells < numBoundaryCells);
+                }
+            }
+        }
+
+    }
+
+BOOST_AUTO_TEST_SUITE_END()